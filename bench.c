@@ -0,0 +1,899 @@
+/*
+ * A libevent-based load generator and latency benchmark for cliserver.
+ *
+ * In the default mode, bench opens -c connections (spread across -t threads,
+ * each with its own event loop), keeps -p commands in flight on each one for
+ * -d seconds, and reports the command throughput and latency percentiles.
+ * Each command is picked at random from the -m mix.  A reply is complete when
+ * the server's "> " prompt arrives at the start of a line.
+ *
+ * With -b, connections use cliserver's binary protocol: each command is sent as
+ * a length-prefixed frame, and a reply is complete when its whole frame has
+ * arrived.
+ *
+ * With -C (churn mode), each connection slot repeatedly connects, sends one
+ * command, waits for the prompt and the reply, and disconnects, measuring
+ * connection setup and teardown on the server (cmd_connect() through
+ * free_cmdsocket()).
+ *
+ * With -u, bench connects to one of the server's --unix sockets instead of
+ * TCP, for comparing local latency.
+ *
+ * (C)2010 Mike Bourgeous, licensed under 2-clause BSD
+ * Contact: mike on nitrogenlogic (it's a dot com domain)
+ *
+ * Example:
+ * ./bench -c 100 -p 16 -d 10 -m echo=8,info=1,help=1
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+
+// Behaves similarly to fprintf(stderr, ...), but adds file, line, and function
+// information.
+#define ERROR_OUT(...) {\
+	fprintf(stderr, "\e[0;1m%s:%d: %s():\t", __FILE__, __LINE__, __FUNCTION__);\
+	fprintf(stderr, __VA_ARGS__);\
+	fprintf(stderr, "\e[0m");\
+}
+
+// Behaves similarly to perror(...), but supports printf formatting and prints
+// file, line, and function information.
+#define ERRNO_OUT(...) {\
+	fprintf(stderr, "\e[0;1m%s:%d: %s():\t", __FILE__, __LINE__, __FUNCTION__);\
+	fprintf(stderr, __VA_ARGS__);\
+	fprintf(stderr, ": %d (%s)\e[0m\n", errno, strerror(errno));\
+}
+
+// Size of array (Caution: references its parameter multiple times)
+#define ARRAY_SIZE(array) (sizeof((array)) / sizeof((array)[0]))
+
+// Latency histogram: values below HIST_SUB nanoseconds get a bucket each, and
+// every power of two above that is split into HIST_SUB buckets, for about 1.5%
+// precision over the whole range.
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+// cliserver's binary protocol (see BIN_MAGIC in cliserver.c)
+#define BIN_MAGIC 0xb1
+#define BIN_HEADER 6
+
+// A command that may be sent, its index in cliserver's command list, and its
+// weight in the mix.  The binary frame is built from the line at startup.
+struct benchcmd {
+	const char *name;
+	const char *line;
+	unsigned int id;
+	unsigned int weight;
+
+	unsigned char *frame;
+	size_t framelen;
+};
+
+static struct benchcmd benchcmds[] = {
+	{ "echo", "echo bench\n", 0, 8 },
+	{ "help", "help\n", 1, 1 },
+	{ "info", "info\n", 2, 1 },
+};
+
+static struct {
+	const char *host;
+	const char *port;
+	const char *unix_path;
+	size_t connections;
+	size_t pipeline;
+	size_t threads;
+	size_t duration;
+	int churn;
+	int binary;
+} config = {
+	.host = "localhost",
+	.port = "14310",
+	.connections = 10,
+	.pipeline = 1,
+	.threads = 1,
+	.duration = 5,
+};
+
+struct benchthread;
+
+struct benchconn {
+	struct benchthread *thread;
+	struct bufferevent *buf_event;
+
+	// Whether the server's initial prompt has arrived
+	int greeted;
+
+	// Length of the binary reply frame being received, or 0 if its header
+	// hasn't arrived yet
+	size_t framelen;
+
+	// Prompt detection state: whether the next byte starts a line, and
+	// whether the current line so far is ">"
+	int line_start;
+	int saw_gt;
+
+	// Send times of the commands in flight, oldest first (a ring of
+	// config.pipeline entries)
+	uint64_t *sent;
+	size_t first, inflight;
+
+	// When the current connection attempt started (churn mode)
+	uint64_t connect_start;
+};
+
+struct benchthread {
+	int id;
+	pthread_t thread;
+	struct event_base *evloop;
+	struct event *stop_event;
+	struct addrinfo *addr;
+
+	struct benchconn *conns;
+	size_t nconns, open;
+
+	// Set when the test duration is over; no new commands are sent
+	int stopping;
+
+	uint32_t rng;
+	uint32_t total_weight;
+
+	// Command latency, and connect-to-prompt latency in churn mode
+	struct histogram latency;
+	struct histogram connect_latency;
+	uint64_t commands, connects, errors;
+};
+
+static void conn_event(struct bufferevent *buf_event, short events, void *arg);
+static void conn_read(struct bufferevent *buf_event, void *arg);
+
+// Returns a monotonic timestamp in nanoseconds
+static uint64_t nsec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t hist_index(uint64_t value)
+{
+	int exp;
+
+	if(value < HIST_SUB) {
+		return value;
+	}
+	exp = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return exp * HIST_SUB + (value >> exp);
+}
+
+// Returns the smallest value that falls into the given bucket
+static uint64_t hist_value(size_t index)
+{
+	int exp;
+
+	if(index < HIST_SUB) {
+		return index;
+	}
+	exp = index / HIST_SUB - 1;
+	return (uint64_t)(index % HIST_SUB + HIST_SUB) << exp;
+}
+
+static void hist_add(struct histogram *hist, uint64_t value)
+{
+	hist->buckets[hist_index(value)]++;
+	hist->count++;
+	if(value > hist->max) {
+		hist->max = value;
+	}
+}
+
+static void hist_merge(struct histogram *dest, const struct histogram *src)
+{
+	size_t i;
+
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		dest->buckets[i] += src->buckets[i];
+	}
+	dest->count += src->count;
+	if(src->max > dest->max) {
+		dest->max = src->max;
+	}
+}
+
+// Returns the value below which the given fraction of samples fall
+static uint64_t hist_percentile(const struct histogram *hist, double fraction)
+{
+	uint64_t target = hist->count * fraction;
+	uint64_t seen = 0;
+	size_t i;
+
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if(seen > target) {
+			return hist_value(i);
+		}
+	}
+
+	return hist->max;
+}
+
+static void print_histogram(const char *label, const struct histogram *hist)
+{
+	if(hist->count == 0) {
+		printf("%s: no samples\n", label);
+		return;
+	}
+
+	printf("%s (usec): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", label,
+			hist_percentile(hist, 0.5) / 1000.0,
+			hist_percentile(hist, 0.99) / 1000.0,
+			hist_percentile(hist, 0.999) / 1000.0,
+			hist->max / 1000.0);
+}
+
+// xorshift32
+static uint32_t next_random(struct benchthread *thread)
+{
+	thread->rng ^= thread->rng << 13;
+	thread->rng ^= thread->rng >> 17;
+	thread->rng ^= thread->rng << 5;
+	return thread->rng;
+}
+
+static const struct benchcmd *pick_command(struct benchthread *thread)
+{
+	uint32_t r = next_random(thread) % thread->total_weight;
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(benchcmds); i++) {
+		if(r < benchcmds[i].weight) {
+			return &benchcmds[i];
+		}
+		r -= benchcmds[i].weight;
+	}
+
+	return &benchcmds[0];
+}
+
+// Sends commands until config.pipeline are in flight (or only one in churn
+// mode, and none once the test is stopping).
+static void fill_pipeline(struct benchconn *conn)
+{
+	size_t depth = config.churn ? 1 : config.pipeline;
+	const struct benchcmd *cmd;
+	uint64_t now = nsec_now();
+
+	while(!conn->thread->stopping && conn->inflight < depth) {
+		cmd = pick_command(conn->thread);
+		if(config.binary ?
+				bufferevent_write(conn->buf_event, cmd->frame, cmd->framelen) :
+				bufferevent_write(conn->buf_event, cmd->line, strlen(cmd->line))) {
+			ERROR_OUT("Error sending a command.\n");
+			conn->thread->errors++;
+			return;
+		}
+		conn->sent[(conn->first + conn->inflight) % config.pipeline] = now;
+		conn->inflight++;
+	}
+}
+
+// Starts a new connection in the given slot.  Returns 0 on success, -1 on
+// error.
+static int open_conn(struct benchconn *conn)
+{
+	struct benchthread *thread = conn->thread;
+	int one = 1;
+
+	conn->greeted = 0;
+	conn->framelen = 0;
+	conn->line_start = 1;
+	conn->saw_gt = 0;
+	conn->first = 0;
+	conn->inflight = 0;
+
+	conn->buf_event = bufferevent_socket_new(thread->evloop, -1, BEV_OPT_CLOSE_ON_FREE);
+	if(conn->buf_event == NULL) {
+		ERROR_OUT("Error creating a connection.\n");
+		thread->errors++;
+		return -1;
+	}
+	bufferevent_setcb(conn->buf_event, conn_read, NULL, conn_event, conn);
+
+	conn->connect_start = nsec_now();
+	if(bufferevent_socket_connect(conn->buf_event, thread->addr->ai_addr, thread->addr->ai_addrlen)) {
+		ERROR_OUT("Error connecting to %s port %s.\n", config.host, config.port);
+		bufferevent_free(conn->buf_event);
+		conn->buf_event = NULL;
+		thread->errors++;
+		return -1;
+	}
+	setsockopt(bufferevent_getfd(conn->buf_event), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	bufferevent_enable(conn->buf_event, EV_READ | EV_WRITE);
+
+	thread->open++;
+
+	// Send the first commands without waiting for the prompt, so servers
+	// using TCP_DEFER_ACCEPT see data right away
+	if(config.binary) {
+		bufferevent_write(conn->buf_event, "\xb1", 1);
+	}
+	fill_pipeline(conn);
+
+	return 0;
+}
+
+// Closes the connection in the given slot.  In churn mode a new connection is
+// opened in its place unless the test is stopping.  The thread's loop exits
+// once every connection is closed.
+static void close_conn(struct benchconn *conn)
+{
+	struct benchthread *thread = conn->thread;
+
+	if(conn->buf_event == NULL) {
+		return;
+	}
+	bufferevent_free(conn->buf_event);
+	conn->buf_event = NULL;
+	thread->open--;
+
+	if(config.churn && !thread->stopping && !open_conn(conn)) {
+		return;
+	}
+
+	if(thread->open == 0) {
+		event_base_loopexit(thread->evloop, NULL);
+	}
+}
+
+// Handles a prompt from the server: either the greeting, or the end of the
+// reply to the oldest command in flight (a complete frame in binary mode).
+// Returns 1 if the connection was closed.
+static int got_prompt(struct benchconn *conn, uint64_t now)
+{
+	struct benchthread *thread = conn->thread;
+	int was_reply = 0;
+
+	if(!conn->greeted) {
+		conn->greeted = 1;
+		if(config.churn) {
+			hist_add(&thread->connect_latency, now - conn->connect_start);
+			thread->connects++;
+		}
+	} else if(conn->inflight > 0) {
+		hist_add(&thread->latency, now - conn->sent[conn->first]);
+		thread->commands++;
+		conn->first = (conn->first + 1) % config.pipeline;
+		conn->inflight--;
+		was_reply = 1;
+	} else {
+		ERROR_OUT("Received a reply with no command in flight.\n");
+		thread->errors++;
+	}
+
+	// In churn mode each connection runs a single command
+	if(conn->inflight == 0 && (thread->stopping || (config.churn && was_reply))) {
+		close_conn(conn);
+		return 1;
+	}
+
+	fill_pipeline(conn);
+	return 0;
+}
+
+// Reads binary reply frames.  The server still sends its "> " greeting
+// before switching to frames.
+static void conn_read_binary(struct benchconn *conn, struct evbuffer *input, uint64_t now)
+{
+	unsigned char header[BIN_HEADER];
+
+	if(!conn->greeted) {
+		if(evbuffer_get_length(input) < 2) {
+			return;
+		}
+		evbuffer_drain(input, 2);
+		if(got_prompt(conn, now)) {
+			return;
+		}
+	}
+
+	for(;;) {
+		if(conn->framelen == 0) {
+			if(evbuffer_copyout(input, header, BIN_HEADER) < BIN_HEADER) {
+				return;
+			}
+			conn->framelen = ((size_t)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3]) + 4;
+			if(header[4] || header[5]) {
+				ERROR_OUT("Server returned status %d.\n", header[4] << 8 | header[5]);
+				conn->thread->errors++;
+			}
+		}
+		if(evbuffer_get_length(input) < conn->framelen) {
+			return;
+		}
+		evbuffer_drain(input, conn->framelen);
+		conn->framelen = 0;
+		if(got_prompt(conn, now)) {
+			return;
+		}
+	}
+}
+
+static void conn_read(struct bufferevent *buf_event, void *arg)
+{
+	struct benchconn *conn = arg;
+	struct evbuffer *input = bufferevent_get_input(buf_event);
+	struct evbuffer_iovec vec[8];
+	uint64_t now = nsec_now();
+	size_t total = 0;
+	const char *c;
+	int n, i;
+	size_t j;
+
+	if(config.binary) {
+		conn_read_binary(conn, input, now);
+		return;
+	}
+
+	n = evbuffer_peek(input, -1, NULL, vec, ARRAY_SIZE(vec));
+	if(n > ARRAY_SIZE(vec)) {
+		n = ARRAY_SIZE(vec);
+	}
+	for(i = 0; i < n; i++) {
+		c = vec[i].iov_base;
+		for(j = 0; j < vec[i].iov_len; j++) {
+			if(conn->saw_gt && c[j] == ' ') {
+				conn->saw_gt = 0;
+				conn->line_start = 1;
+				if(got_prompt(conn, now)) {
+					// The connection (and its input buffer) is gone
+					return;
+				}
+				continue;
+			}
+			conn->saw_gt = conn->line_start && c[j] == '>';
+			conn->line_start = c[j] == '\n';
+		}
+		total += vec[i].iov_len;
+	}
+	evbuffer_drain(input, total);
+}
+
+static void conn_event(struct bufferevent *buf_event, short events, void *arg)
+{
+	struct benchconn *conn = arg;
+
+	if(events & BEV_EVENT_CONNECTED) {
+		return;
+	}
+
+	if(!conn->thread->stopping || conn->inflight) {
+		if(events & BEV_EVENT_EOF) {
+			ERROR_OUT("Server closed a connection.\n");
+		} else {
+			ERROR_OUT("Connection error (0x%hx): %s\n", events,
+					evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		}
+		conn->thread->errors++;
+	}
+
+	close_conn(conn);
+}
+
+static void stop_thread(evutil_socket_t fd, short events, void *arg)
+{
+	struct benchthread *thread = arg;
+	static const struct timeval grace = { 5, 0 };
+	size_t i;
+
+	thread->stopping = 1;
+
+	// Connections with nothing in flight can close now; the rest close as
+	// their last replies arrive
+	for(i = 0; i < thread->nconns; i++) {
+		if(thread->conns[i].buf_event != NULL && thread->conns[i].inflight == 0) {
+			close_conn(&thread->conns[i]);
+		}
+	}
+	if(thread->open == 0) {
+		event_base_loopexit(thread->evloop, NULL);
+	}
+
+	// Don't wait forever for a server that stopped responding
+	event_base_loopexit(thread->evloop, &grace);
+}
+
+static void *run_thread(void *arg)
+{
+	struct benchthread *thread = arg;
+	struct timeval duration = { config.duration, 0 };
+	size_t i;
+
+	event_add(thread->stop_event, &duration);
+
+	for(i = 0; i < thread->nconns; i++) {
+		open_conn(&thread->conns[i]);
+	}
+
+	event_base_dispatch(thread->evloop);
+
+	for(i = 0; i < thread->nconns; i++) {
+		if(thread->conns[i].buf_event != NULL) {
+			bufferevent_free(thread->conns[i].buf_event);
+		}
+		free(thread->conns[i].sent);
+	}
+
+	return NULL;
+}
+
+// Builds the binary protocol frame for each command.  Returns 0 on success, -1
+// on error.
+static int build_frames(void)
+{
+	const char *params;
+	size_t len;
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(benchcmds); i++) {
+		// Parameters follow the first space, and exclude the newline
+		params = strchr(benchcmds[i].line, ' ');
+		params = params != NULL ? params + 1 : strchr(benchcmds[i].line, '\n');
+		len = strchr(params, '\n') - params;
+
+		benchcmds[i].framelen = BIN_HEADER + len;
+		benchcmds[i].frame = malloc(benchcmds[i].framelen);
+		if(benchcmds[i].frame == NULL) {
+			ERRNO_OUT("Error allocating frame for %s", benchcmds[i].name);
+			return -1;
+		}
+		benchcmds[i].frame[0] = (len + 2) >> 24;
+		benchcmds[i].frame[1] = (len + 2) >> 16;
+		benchcmds[i].frame[2] = (len + 2) >> 8;
+		benchcmds[i].frame[3] = len + 2;
+		benchcmds[i].frame[4] = benchcmds[i].id >> 8;
+		benchcmds[i].frame[5] = benchcmds[i].id;
+		memcpy(benchcmds[i].frame + BIN_HEADER, params, len);
+	}
+
+	return 0;
+}
+
+// Parses a command mix such as "echo=8,info=1,help=1".  Commands that aren't
+// listed get a weight of zero.  Returns 0 on success, -1 on error.
+static int parse_mix(char *mix)
+{
+	char *item, *weight, *save;
+	unsigned int total = 0;
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(benchcmds); i++) {
+		benchcmds[i].weight = 0;
+	}
+
+	for(item = strtok_r(mix, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		weight = strchr(item, '=');
+		if(weight != NULL) {
+			*weight++ = 0;
+		}
+
+		for(i = 0; i < ARRAY_SIZE(benchcmds); i++) {
+			if(!strcmp(item, benchcmds[i].name)) {
+				break;
+			}
+		}
+		if(i == ARRAY_SIZE(benchcmds)) {
+			ERROR_OUT("Unknown command in mix: %s\n", item);
+			return -1;
+		}
+
+		benchcmds[i].weight = weight != NULL ? strtoul(weight, NULL, 10) : 1;
+		total += benchcmds[i].weight;
+	}
+
+	if(total == 0) {
+		ERROR_OUT("The command mix must have a nonzero weight.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Parses a positive decimal number.  Returns 0 on success, -1 on error.
+static int parse_count(const char *str, size_t *value)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if(errno || end == str || *end != 0 || *str == '-' || val == 0) {
+		return -1;
+	}
+
+	*value = val;
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -H, --host=HOST         Server to connect to (default %s)\n"
+			"  -P, --port=PORT         Server port (default %s)\n"
+			"  -u, --unix=PATH         Connect to UNIX socket PATH (@NAME for abstract) instead\n"
+			"  -c, --connections=N     Number of connections (default %zu)\n"
+			"  -p, --pipeline=N        Commands in flight per connection (default %zu)\n"
+			"  -t, --threads=N         Client threads (default %zu)\n"
+			"  -d, --duration=SECONDS  Test duration (default %zu)\n"
+			"  -m, --mix=MIX           Command mix, e.g. echo=8,info=1,help=1\n"
+			"  -b, --binary            Use the binary protocol\n"
+			"  -C, --churn             Reconnect after every command\n"
+			"  -h, --help              Show this help\n",
+			progname, config.host, config.port, config.connections,
+			config.pipeline, config.threads, config.duration);
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "host", required_argument, NULL, 'H' },
+		{ "port", required_argument, NULL, 'P' },
+		{ "unix", required_argument, NULL, 'u' },
+		{ "connections", required_argument, NULL, 'c' },
+		{ "pipeline", required_argument, NULL, 'p' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "mix", required_argument, NULL, 'm' },
+		{ "binary", no_argument, NULL, 'b' },
+		{ "churn", no_argument, NULL, 'C' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	size_t *count;
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "H:P:u:c:p:t:d:m:bCh", options, NULL)) != -1) {
+		count = NULL;
+		switch(opt) {
+			case 'H':
+				config.host = optarg;
+				break;
+
+			case 'P':
+				config.port = optarg;
+				break;
+
+			case 'u':
+				config.unix_path = optarg;
+				break;
+
+			case 'c':
+				count = &config.connections;
+				break;
+
+			case 'p':
+				count = &config.pipeline;
+				break;
+
+			case 't':
+				count = &config.threads;
+				break;
+
+			case 'd':
+				count = &config.duration;
+				break;
+
+			case 'm':
+				if(parse_mix(optarg)) {
+					return -1;
+				}
+				break;
+
+			case 'b':
+				config.binary = 1;
+				break;
+
+			case 'C':
+				config.churn = 1;
+				break;
+
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+
+		if(count != NULL && parse_count(optarg, count)) {
+			ERROR_OUT("Invalid value for -%c: %s\n", opt, optarg);
+			return -1;
+		}
+	}
+
+	if(optind < argc) {
+		ERROR_OUT("Unexpected argument: %s\n", argv[optind]);
+		usage(argv[0]);
+		return -1;
+	}
+
+	if(config.threads > config.connections) {
+		config.threads = config.connections;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct benchthread *threads;
+	struct histogram *latency, *connect_latency;
+	uint64_t commands = 0, connects = 0, errors = 0;
+	uint64_t start, elapsed;
+	struct sockaddr_un unix_addr;
+	struct addrinfo unix_ai;
+	struct addrinfo *addr;
+	size_t i, j, len;
+	int ret;
+
+	if(parse_args(argc, argv) || build_frames()) {
+		return -1;
+	}
+
+	if(config.unix_path != NULL) {
+		// A leading @ names a socket in the abstract namespace, which has
+		// no NUL terminator
+		len = strlen(config.unix_path);
+		memset(&unix_addr, 0, sizeof(unix_addr));
+		unix_addr.sun_family = AF_UNIX;
+		if(len == 0 || (config.unix_path[0] == '@' && len == 1) || len >= sizeof(unix_addr.sun_path)) {
+			ERROR_OUT("Invalid UNIX socket path: %s\n", config.unix_path);
+			return -1;
+		}
+		memcpy(unix_addr.sun_path, config.unix_path, len);
+		if(config.unix_path[0] == '@') {
+			unix_addr.sun_path[0] = 0;
+			len--;
+		}
+
+		memset(&unix_ai, 0, sizeof(unix_ai));
+		unix_ai.ai_family = AF_UNIX;
+		unix_ai.ai_socktype = SOCK_STREAM;
+		unix_ai.ai_addr = (struct sockaddr *)&unix_addr;
+		unix_ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+		addr = &unix_ai;
+	} else {
+		ret = getaddrinfo(config.host, config.port, &hints, &addr);
+		if(ret) {
+			ERROR_OUT("Error looking up %s port %s: %s\n", config.host, config.port, gai_strerror(ret));
+			return -1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	threads = calloc(config.threads, sizeof(struct benchthread));
+	latency = calloc(1, sizeof(struct histogram));
+	connect_latency = calloc(1, sizeof(struct histogram));
+	if(threads == NULL || latency == NULL || connect_latency == NULL) {
+		ERRNO_OUT("Error allocating benchmark threads");
+		return -1;
+	}
+
+	for(i = 0; i < config.threads; i++) {
+		threads[i].id = i;
+		threads[i].addr = addr;
+		threads[i].rng = 2463534242u + i * 7919;
+		for(j = 0; j < ARRAY_SIZE(benchcmds); j++) {
+			threads[i].total_weight += benchcmds[j].weight;
+		}
+
+		threads[i].evloop = event_base_new();
+		if(threads[i].evloop == NULL) {
+			ERROR_OUT("Error creating event loop for thread %zu.\n", i);
+			return -1;
+		}
+		threads[i].stop_event = evtimer_new(threads[i].evloop, stop_thread, &threads[i]);
+
+		// Spread the connections as evenly as possible
+		threads[i].nconns = config.connections / config.threads + (i < config.connections % config.threads);
+		threads[i].conns = calloc(threads[i].nconns, sizeof(struct benchconn));
+		if(threads[i].conns == NULL || threads[i].stop_event == NULL) {
+			ERRNO_OUT("Error allocating connections for thread %zu", i);
+			return -1;
+		}
+		for(j = 0; j < threads[i].nconns; j++) {
+			threads[i].conns[j].thread = &threads[i];
+			threads[i].conns[j].sent = calloc(config.pipeline, sizeof(uint64_t));
+			if(threads[i].conns[j].sent == NULL) {
+				ERRNO_OUT("Error allocating connection state");
+				return -1;
+			}
+		}
+	}
+
+	printf("%zu connections, %zu threads, %zu seconds, %s, %s protocol\n", config.connections, config.threads,
+			config.duration, config.churn ? "reconnecting after each command" : "persistent connections",
+			config.binary ? "binary" : "line");
+	if(!config.churn) {
+		printf("%zu commands in flight per connection\n", config.pipeline);
+	}
+
+	start = nsec_now();
+	for(i = 0; i < config.threads; i++) {
+		errno = pthread_create(&threads[i].thread, NULL, run_thread, &threads[i]);
+		if(errno) {
+			ERRNO_OUT("Error starting thread %zu", i);
+			return -1;
+		}
+	}
+	for(i = 0; i < config.threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+
+		hist_merge(latency, &threads[i].latency);
+		hist_merge(connect_latency, &threads[i].connect_latency);
+		commands += threads[i].commands;
+		connects += threads[i].connects;
+		errors += threads[i].errors;
+
+		event_free(threads[i].stop_event);
+		event_base_free(threads[i].evloop);
+		free(threads[i].conns);
+	}
+	elapsed = nsec_now() - start;
+
+	printf("%llu commands in %.2f seconds: %.0f commands/sec\n", (unsigned long long)commands,
+			elapsed / 1e9, commands / (elapsed / 1e9));
+	print_histogram("Command latency", latency);
+	if(config.churn) {
+		printf("%llu connections: %.0f connections/sec\n", (unsigned long long)connects,
+				connects / (elapsed / 1e9));
+		print_histogram("Connect latency", connect_latency);
+	}
+	if(errors) {
+		printf("%llu errors\n", (unsigned long long)errors);
+	}
+
+	for(i = 0; i < ARRAY_SIZE(benchcmds); i++) {
+		free(benchcmds[i].frame);
+	}
+	free(threads);
+	free(latency);
+	free(connect_latency);
+	if(addr != &unix_ai) {
+		freeaddrinfo(addr);
+	}
+
+	return errors ? 1 : 0;
+}
@@ -1,16 +1,136 @@
 /*
  * An event-driven server that handles simple commands from multiple clients.
- * If no command is received for 60 seconds, the client will be disconnected.
+ * If no data is received from a client for 60 seconds (see --timeout), the
+ * client will be disconnected.
  *
- * Note that evbuffer_readline() is a potential source of denial of service, as
- * it does an O(n) scan for a newline character each time it is called.  One
- * solution would be checking the length of the buffer and dropping the
- * connection if the buffer exceeds some limit (dropping the data is less
- * desirable, as the client is clearly not speaking our protocol anyway).
- * Another (more ideal) solution would be starting the newline search at the
- * end of the existing buffer.  The server won't crash with really long lines
- * within the limits of system RAM (tested using lines up to 1GB in length), it
- * just runs slowly.
+ * Lines are terminated by any sequence of CR and LF characters.  Each
+ * connection remembers how much of its partial line has already been searched
+ * for a line terminator, so a client that sends a long line a few bytes at a
+ * time only costs a scan of the newly arrived bytes on each read.  Clients
+ * sending a line longer than the maximum line length (64KB by default, see
+ * --max-line) are disconnected, as they are clearly not speaking our protocol.
+ * Complete lines are found up to SCAN_BATCH at a time by scan_lines(), which
+ * makes one vectorized pass (AVX2 or SSE2, picked at startup, with a scalar
+ * fallback) over 64-byte blocks to find both the terminators and the command
+ * name of each line.
+ *
+ * By default all connections are served by a single event loop.  With
+ * --threads N, N event loops are started, each in its own thread with its own
+ * listening socket bound to the same port using SO_REUSEPORT, so the kernel
+ * spreads incoming connections across the loops.  Local clients may connect
+ * to --unix sockets instead, which every loop accepts from.  A connection
+ * stays on the loop that accepted it for its whole lifetime, so connections
+ * and commands never need to be locked.  The event bases are created without
+ * locks as well; other threads only ever wake a loop through its eventfd (see
+ * wake_loop()).
+ *
+ * Each read callback runs at most --cmd-budget commands for its connection.
+ * If complete lines are still waiting after that, the connection is put at
+ * the back of its loop's ready queue, which is served round-robin (again
+ * --cmd-budget commands per connection per turn) on the following event loop
+ * iterations, so a client pipelining thousands of commands neither waits for
+ * more data to arrive nor starves the other clients on its loop.  With --cork,
+ * TCP_CORK is set on a connection while it is in the ready queue, so the
+ * kernel sends the replies to a pipelined batch in full segments.
+ *
+ * Replies are collected in each connection's output buffer and handed to its
+ * bufferevent at the end of each turn; the bufferevent writes everything that
+ * has accumulated with a single writev() per event loop iteration.  Constant
+ * strings are copied into the output buffer if they are short, or referenced
+ * with evbuffer_add_reference() if they are long enough to be worth it.
+ *
+ * Output is bounded per connection: a client with more than --write-high bytes
+ * of unsent output stops being read from (and its pipelined commands stop
+ * running) until it has read its output down to --write-low bytes, and no
+ * more than --read-high bytes are read ahead of the commands being run.
+ *
+ * Commands flagged CMD_OFFLOAD (those that may block, such as resolve) are
+ * queued to a pool of --workers threads, and their output is passed back to
+ * the connection's loop through an eventfd.  The connection's later commands
+ * wait until the offloaded one finishes, so its replies stay in order; every
+ * other command runs directly on the loop.
+ *
+ * Clients may be limited to --rate bytes per second (and all clients together
+ * to --global-rate) with libevent's token bucket rate limits, and to
+ * --cmd-rate commands per second with a token bucket checked before each
+ * command; a throttled client waits in its loop's throttle queue instead of
+ * being disconnected.
+ *
+ * Clients that subscribe receive the messages other clients broadcast.  A
+ * broadcast is built once (see struct broadcast), handed to every loop, and
+ * added by reference to each subscriber's output, BROADCAST_BUDGET
+ * subscribers per event loop iteration.
+ *
+ * With --tls-cert (when built with make tls), every connection's
+ * bufferevent is replaced by a libevent OpenSSL bufferevent that does the
+ * handshake and encryption.  Session tickets and a session cache shared by
+ * every loop let reconnecting clients skip the key exchange, and --ktls asks
+ * OpenSSL to hand encryption to the kernel after the handshake.
+ *
+ * With --io-uring, each loop accepts, reads, and writes through its own
+ * io_uring instead (see struct uring): one multishot accept per listening
+ * socket, a multishot recv per connection into buffers provided by the loop,
+ * and sends submitted in one batch per event loop iteration.  Received data
+ * is copied into the bufferevent's input buffer and output is sent straight
+ * from its output buffer, so everything above the socket is unchanged.
+ *
+ * Idle timeouts are tracked with a hashed timing wheel on each loop instead of
+ * a timer per connection: a read only records the time, and a single
+ * once-per-second event visits the wheel slot whose connections are due,
+ * closing the ones that really have been idle and moving the rest to the slot
+ * for their new deadline.
+ *
+ * Connection state is kept in a per-loop pool of struct cmdsocket objects,
+ * each with a bufferevent created ahead of time.  Closing a connection resets
+ * its bufferevent and returns it to the pool instead of freeing it, so
+ * connection churn doesn't hit the allocator.  Output is collected in buffers
+ * that the loop lends to connections only until their output is flushed, so
+ * an idle connection costs little more than its cmdsocket and bufferevent.
+ * The pool starts with --pool-size entries per loop and grows by --pool-grow
+ * entries at a time when it runs dry; it never shrinks until the server shuts
+ * down.
+ *
+ * A client that sends the byte BIN_MAGIC first switches its connection to a
+ * binary protocol of length-prefixed frames that name a command by its index
+ * in commands[], so requests are dispatched without any text parsing and
+ * replies are framed instead of followed by a prompt.
+ *
+ * Requests on either protocol may carry a client's tag (see TAG_MAX), which is
+ * sent back with the reply.  A tagged offloaded command doesn't hold up the
+ * client's later commands, so tagged replies are sent as soon as they are
+ * ready, in any order, while untagged replies keep the order of the requests.
+ *
+ * Shutting down drains each loop: it stops accepting, closes idle connections
+ * immediately, and closes busy ones once their output has been sent.  With
+ * --handoff, a restarted server receives the listening sockets of the running
+ * one over a UNIX socket before the old one drains, so connections waiting to
+ * be accepted are never dropped.
+ *
+ * --cpus pins each loop's thread to a CPU.  A pinned loop allocates its pool
+ * from its own thread so that the pool is local to the CPU's NUMA node, and
+ * --steer attaches a BPF program to the SO_REUSEPORT group that hands each new
+ * connection to the loop on the CPU that received it.
+ *
+ * Each loop keeps its open connections in a dense array for iteration, and a
+ * global table indexed by file descriptor maps connection ids (a file
+ * descriptor plus a generation number) to connections in constant time.
+ * Rarely used connection details such as the client's address aren't stored
+ * at all; the info command asks the kernel for them.
+ *
+ * Each loop keeps counters of connections, lines, commands, bytes, errors, and
+ * command execution times, written only by the loop's own thread.  The stats
+ * command adds up every loop's counters, and --stats-interval logs each
+ * loop's counters and busiest client periodically.
+ *
+ * With --trace N, one in N commands is timed from the read that brought it to
+ * the flush that sent its reply (see struct trace_record).  Each loop writes
+ * finished traces to its own ring, guarded per slot by a sequence number, so
+ * the trace command can read every loop's ring without stopping them.
+ *
+ * Commands are looked up in a command set: commands[] followed by the
+ * commands of every --module (see module.h), which the reload command rebuilds.
+ * Loops switch to a new set between callbacks, and a set and its modules stay
+ * loaded while any loop, offloaded job, or unsent help reply still uses it.
  *
  * Created Dec. 19-21, 2010 while learning to use libevent 1.4.
  * (C)2010 Mike Bourgeous, licensed under 2-clause BSD
@@ -28,538 +148,7105 @@
  * valgrind --leak-check=full --show-reachable=yes --track-fds=yes --track-origins=yes --read-var-info=yes ./cliserver
  * echo "info" | eval "$(for f in `seq 1 100`; do echo -n nc -q 10 localhost 14310 '| '; done; echo nc -q 10 localhost 14310)"
  */
+#define _GNU_SOURCE // For accept4()
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <event.h>
+#include <netdb.h>
+#include <linux/filter.h>
+#include <malloc.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#include <event2/event.h>
+#include <event2/event_struct.h>	// Events are embedded in structs and set up with event_assign()
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#ifdef HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <event2/bufferevent_ssl.h>
+#endif
+
+#include "module.h"
+
+// The io_uring engine (see --io-uring) needs multishot accept and recv, and
+// provided buffer rings (Linux 6.0)
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_IO_URING 1
+#endif
+
+
+// Log levels.  Messages above LOG_LEVEL are compiled out entirely (build with
+// -DLOG_LEVEL=0, or "make nolog", to remove all logging); messages above the
+// runtime log level (--log-level) cost a single branch.
+#define LOG_NONE	0
+#define LOG_ERROR	1
+#define LOG_INFO	2
+#define LOG_DEBUG	3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
 
+// The runtime log level
+static int log_level = LOG_INFO;
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL && (level) <= log_level)
+
+static void log_msg(int level, const char *file, int line, const char *func, int errnum, const char *fmt, ...)
+	__attribute__((format(printf, 6, 7)));
 
 // Behaves similarly to printf(...), but adds file, line, and function
 // information.  I omit do ... while(0) because I always use curly braces in my
 // if statements.
 #define INFO_OUT(...) {\
-	printf("%s:%d: %s():\t", __FILE__, __LINE__, __FUNCTION__);\
-	printf(__VA_ARGS__);\
+	if(LOG_ENABLED(LOG_INFO)) {\
+		log_msg(LOG_INFO, __FILE__, __LINE__, __FUNCTION__, -1, __VA_ARGS__);\
+	}\
+}
+
+// Like INFO_OUT, for messages printed for every line or command (shown with
+// --log-level=debug)
+#define DEBUG_OUT(...) {\
+	if(LOG_ENABLED(LOG_DEBUG)) {\
+		log_msg(LOG_DEBUG, __FILE__, __LINE__, __FUNCTION__, -1, __VA_ARGS__);\
+	}\
 }
 
 // Behaves similarly to fprintf(stderr, ...), but adds file, line, and function
 // information.
 #define ERROR_OUT(...) {\
-	fprintf(stderr, "\e[0;1m%s:%d: %s():\t", __FILE__, __LINE__, __FUNCTION__);\
-	fprintf(stderr, __VA_ARGS__);\
-	fprintf(stderr, "\e[0m");\
+	if(LOG_ENABLED(LOG_ERROR)) {\
+		log_msg(LOG_ERROR, __FILE__, __LINE__, __FUNCTION__, -1, __VA_ARGS__);\
+	}\
 }
 
 // Behaves similarly to perror(...), but supports printf formatting and prints
 // file, line, and function information.
 #define ERRNO_OUT(...) {\
-	fprintf(stderr, "\e[0;1m%s:%d: %s():\t", __FILE__, __LINE__, __FUNCTION__);\
-	fprintf(stderr, __VA_ARGS__);\
-	fprintf(stderr, ": %d (%s)\e[0m\n", errno, strerror(errno));\
+	if(LOG_ENABLED(LOG_ERROR)) {\
+		log_msg(LOG_ERROR, __FILE__, __LINE__, __FUNCTION__, errno, __VA_ARGS__);\
+	}\
 }
 
-// Size of array (Caution: references its parameter multiple times)
-#define ARRAY_SIZE(array) (sizeof((array)) / sizeof((array)[0]))
-
-// Prints a message and returns 1 if o is NULL, returns 0 otherwise
-#define CHECK_NULL(o) ( (o) == NULL ? ( fprintf(stderr, "\e[0;1m%s is null.\e[0m\n", #o), 1 ) : 0 )
+// Expands to the arguments for printing a string that isn't NUL-terminated
+// with "%.*s"
+#define LEN_STR(len, str) (int)(len), (str)
 
-struct cmdsocket {
-	// The file descriptor for this client's socket
-	int fd;
+// Number of one-second slots in each loop's timeout wheel (must be a power of
+// two up to 2048; timeouts longer than this just cost an extra visit per
+// wheel turn)
+#define WHEEL_SLOTS 64
 
-	// Whether this socket has been shut down
-	int shutdown;
+// Constant strings at least this long are added to output buffers by
+// reference instead of by copying them (a reference costs a chunk allocation,
+// which is more expensive than copying a short string)
+#define STATIC_REF_MIN 256
 
-	// The client's socket address
-	struct sockaddr_in6 addr;
+// Maximum number of emptied output buffers each loop keeps to lend to clients
+// (see cmdsocket_output())
+#define SPARE_OUTPUTS 64
 
-	// The server's event loop
-	struct event_base *evloop;
+// Number of times per second that --rate and --global-rate buckets are
+// refilled
+#define RATE_TICKS 10
 
-	// The client's buffered I/O event
-	struct bufferevent *buf_event;
+// Maximum number of UNIX sockets to listen on (see --unix)
+#define MAX_LOCAL_LISTENERS 8
 
-	// The client's output buffer (commands should write to this buffer,
-	// which is flushed at the end of each command processing loop)
-	struct evbuffer *buffer;
+// Maximum number of command modules (see --module)
+#define MAX_MODULES 16
 
-	// Doubly-linked list (so removal is fast) for cleaning up at shutdown
-	struct cmdsocket *prev, *next;
-};
+// Number of sampled command traces each loop keeps (a power of two), and the
+// number of sampled commands each loop can have waiting to run or be flushed
+#define TRACE_SLOTS 4096
+#define TRACE_PENDING 64
 
-struct command {
-	char *name;
-	char *desc;
-	void (*func)(struct cmdsocket *cmdsocket, struct command *command, const char *params);
-};
+// Number of power-of-two buckets in the command time histogram (the last one
+// also holds everything slower than 2^STATS_LAT_BUCKETS nanoseconds)
+#define STATS_LAT_BUCKETS 32
 
-static void echo_func(struct cmdsocket *cmdsocket, struct command *command, const char *params);
-static void help_func(struct cmdsocket *cmdsocket, struct command *command, const char *params);
-static void info_func(struct cmdsocket *cmdsocket, struct command *command, const char *params);
-static void quit_func(struct cmdsocket *cmdsocket, struct command *command, const char *params);
-static void kill_func(struct cmdsocket *cmdsocket, struct command *command, const char *params);
+// Updates a loop's counter.  Only the loop's own thread writes its counters,
+// so a plain read followed by a relaxed atomic store is enough to let other
+// threads read them safely without a locked instruction on the hot path.
+#define STAT_ADD(loop, counter, n) __atomic_store_n(&(loop)->stats.counter, (loop)->stats.counter + (n), __ATOMIC_RELAXED)
 
-static void shutdown_cmdsocket(struct cmdsocket *cmdsocket);
+// Reads a counter that may belong to another loop
+#define STAT_GET(loop, counter) __atomic_load_n(&(loop)->stats.counter, __ATOMIC_RELAXED)
 
-static struct command commands[] = {
-	{ "echo", "Prints the command line.", echo_func },
-	{ "help", "Prints a list of commands and their descriptions.", help_func },
-	{ "info", "Prints connection information.", info_func },
-	{ "quit", "Disconnects from the server.", quit_func },
-	{ "kill", "Shuts down the server.", kill_func },
-};
+// Binary protocol.  A client that sends BIN_MAGIC as its first byte switches
+// its connection to length-prefixed frames instead of lines.  Requests are a
+// 4-byte big-endian length of the rest of the frame, a 2-byte big-endian index
+// into commands[], and the command's parameters.  Replies are a 4-byte length,
+// a 2-byte status (BIN_OK or BIN_UNKNOWN), and the command's output.  No
+// prompts are sent after the initial one.  Subscribers also receive frames
+// with status BIN_BROADCAST between replies.
+#define BIN_MAGIC	0xb1
+#define BIN_HEADER	6
+#define BIN_OK		0
+#define BIN_UNKNOWN	1
+#define BIN_BROADCAST	2
 
-// List of open connections to be cleaned up at server shutdown
-static struct cmdsocket cmd_listhead = { .next = NULL };
-static struct cmdsocket * const socketlist = &cmd_listhead;
+// Tagged requests.  A text line may start with @TAG (1 to TAG_MAX characters
+// other than blanks) before its command, and a binary request may set
+// BIN_TAGGED in its command index and start its parameters with a BIN_TAG-byte
+// tag.  The reply carries the tag: "@TAG LENGTH\n" and LENGTH bytes of output
+// instead of the output and a prompt, or a frame with BIN_TAGGED set in its
+// status and the tag in front of the output.  An offloaded tagged command
+// doesn't hold up the client's later commands, so its reply may come after
+// theirs.  A client may have TAGGED_JOBS tagged commands offloaded at a time,
+// and an untagged request waits until they have all finished, so untagged
+// replies stay in order.
+#define TAG_MAX		32
+#define TAGGED_JOBS	256
+#define BIN_TAGGED	0x8000
+#define BIN_TAG		4
 
+// Size of array (Caution: references its parameter multiple times)
+#define ARRAY_SIZE(array) (sizeof((array)) / sizeof((array)[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static void echo_func(struct cmdsocket *cmdsocket, struct command *command, const char *params)
-{
-	INFO_OUT("%s %s\n", command->name, params);
-	evbuffer_add_printf(cmdsocket->buffer, "%s\n", params);
-}
+// Prints a message and returns 1 if o is NULL, returns 0 otherwise
+#define CHECK_NULL(o) ( (o) == NULL ? ( fprintf(stderr, "\e[0;1m%s is null.\e[0m\n", #o), 1 ) : 0 )
 
-static void help_func(struct cmdsocket *cmdsocket, struct command *command, const char *params)
-{
-	int i;
+// With --async-log, messages are formatted into this ring of fixed-size slots
+// by whichever thread logs them, and written out by a background thread, so
+// logging never waits for stdout or stderr.  The ring is a bounded
+// multi-producer queue in which each slot's sequence number says whether it
+// is free for the producer claiming position seq, or holds the message for
+// position seq - 1.  Messages are dropped (and counted) when the ring is full.
+#define LOG_RING_SLOTS 4096
+#define LOG_MSG_MAX 256
 
-	INFO_OUT("%s %s\n", command->name, params);
+struct log_slot {
+	uint64_t seq;
+	int level;
+	int len;
+	char msg[LOG_MSG_MAX];
+};
 
-	for(i = 0; i < ARRAY_SIZE(commands); i++) {
-		evbuffer_add_printf(cmdsocket->buffer, "%s:\t%s\n", commands[i].name, commands[i].desc);
-	}
-}
+static struct {
+	struct log_slot *slots;
+	uint64_t head;		// Next position for producers (shared)
+	uint64_t tail;		// Next position for the writer thread
+	uint64_t dropped;
+	int running;
+	pthread_t thread;
+} log_ring;
 
-static void info_func(struct cmdsocket *cmdsocket, struct command *command, const char *params)
+// Formats a log message for the log ring the same way log_msg() prints it
+// directly.  Returns the formatted length (truncated to size - 1 if it didn't
+// fit).
+static int format_log(char *buf, size_t size, int level, const char *file, int line, const char *func,
+		int errnum, const char *fmt, va_list args)
 {
-	char addr[INET6_ADDRSTRLEN];
-	const char *addr_start;
+	int len, ret;
+
+	len = snprintf(buf, size, "%s%s:%d: %s():\t", level == LOG_ERROR ? "\e[0;1m" : "", file, line, func);
+	if(len < 0 || len >= size) {
+		return size - 1;
+	}
 
-	INFO_OUT("%s %s\n", command->name, params);
+	ret = vsnprintf(buf + len, size - len, fmt, args);
+	if(ret < 0 || ret >= size - len) {
+		return size - 1;
+	}
+	len += ret;
 
-	addr_start = inet_ntop(cmdsocket->addr.sin6_family, &cmdsocket->addr.sin6_addr, addr, sizeof(addr));
-	if(!strncmp(addr, "::ffff:", 7) && strchr(addr, '.') != NULL) {
-		addr_start += 7;
+	if(errnum >= 0) {
+		ret = snprintf(buf + len, size - len, ": %d (%s)\e[0m\n", errnum, strerror(errnum));
+	} else if(level == LOG_ERROR) {
+		ret = snprintf(buf + len, size - len, "\e[0m");
+	} else {
+		ret = 0;
+	}
+	if(ret < 0 || ret >= size - len) {
+		return size - 1;
 	}
 
-	evbuffer_add_printf(
-			cmdsocket->buffer,
-			"Client address: %s\nClient port: %hu\n",
-			addr_start,
-			cmdsocket->addr.sin6_port
-			);
+	return len + ret;
 }
 
-static void quit_func(struct cmdsocket *cmdsocket, struct command *command, const char *params)
+static void log_msg(int level, const char *file, int line, const char *func, int errnum, const char *fmt, ...)
 {
-	INFO_OUT("%s %s\n", command->name, params);
-	shutdown_cmdsocket(cmdsocket);
-}
+	FILE *out = level == LOG_ERROR ? stderr : stdout;
+	struct log_slot *slot;
+	uint64_t pos, seq;
+	va_list args;
 
-static void kill_func(struct cmdsocket *cmdsocket, struct command *command, const char *params)
-{
-	INFO_OUT("%s %s\n", command->name, params);
+	if(__atomic_load_n(&log_ring.running, __ATOMIC_ACQUIRE)) {
+		pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+		for(;;) {
+			slot = &log_ring.slots[pos & (LOG_RING_SLOTS - 1)];
+			seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if(seq == pos) {
+				if(__atomic_compare_exchange_n(&log_ring.head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					break;
+				}
+			} else if(seq < pos) {
+				// The ring is full
+				__atomic_fetch_add(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+				return;
+			} else {
+				pos = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+			}
+		}
 
-	INFO_OUT("Shutting down server.\n");
-	if(event_base_loopexit(cmdsocket->evloop, NULL)) {
-		ERROR_OUT("Error shutting down server\n");
+		va_start(args, fmt);
+		slot->len = format_log(slot->msg, sizeof(slot->msg), level, file, line, func, errnum, fmt, args);
+		va_end(args);
+		slot->level = level;
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+		return;
 	}
-	
-	shutdown_cmdsocket(cmdsocket);
-}
 
-static void add_cmdsocket(struct cmdsocket *cmdsocket)
-{
-	cmdsocket->prev = socketlist;
-	cmdsocket->next = socketlist->next;
-	if(socketlist->next != NULL) {
-		socketlist->next->prev = cmdsocket;
+	// Lock the stream so messages from different threads don't interleave
+	flockfile(out);
+	fprintf(out, "%s%s:%d: %s():\t", level == LOG_ERROR ? "\e[0;1m" : "", file, line, func);
+	va_start(args, fmt);
+	vfprintf(out, fmt, args);
+	va_end(args);
+	if(errnum >= 0) {
+		fprintf(out, ": %d (%s)\e[0m\n", errnum, strerror(errnum));
+	} else if(level == LOG_ERROR) {
+		fprintf(out, "\e[0m");
 	}
-	socketlist->next = cmdsocket;
+	funlockfile(out);
 }
 
-static struct cmdsocket *create_cmdsocket(int sockfd, struct sockaddr_in6 *remote_addr, struct event_base *evloop)
+// Writes messages from the log ring to stdout and stderr until logging is
+// stopped and the ring is empty.
+static void *log_thread(void *arg)
 {
-	struct cmdsocket *cmdsocket;
-
-	cmdsocket = calloc(1, sizeof(struct cmdsocket));
-	if(cmdsocket == NULL) {
-		ERRNO_OUT("Error allocating command handler info");
-		close(sockfd);
-		return NULL;
-	}
-	cmdsocket->fd = sockfd;
-	cmdsocket->addr = *remote_addr;
-	cmdsocket->evloop = evloop;
+	struct log_slot *slot;
+	uint64_t dropped;
+	int running, wrote;
 
-	add_cmdsocket(cmdsocket);
+	do {
+		running = __atomic_load_n(&log_ring.running, __ATOMIC_ACQUIRE);
+		wrote = 0;
 
-	return cmdsocket;
-}
+		for(;;) {
+			slot = &log_ring.slots[log_ring.tail & (LOG_RING_SLOTS - 1)];
+			if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_ring.tail + 1) {
+				break;
+			}
 
-static void free_cmdsocket(struct cmdsocket *cmdsocket)
-{
-	if(CHECK_NULL(cmdsocket)) {
-		abort();
-	}
+			fwrite(slot->msg, 1, slot->len, slot->level == LOG_ERROR ? stderr : stdout);
+			__atomic_store_n(&slot->seq, log_ring.tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+			log_ring.tail++;
+			wrote = 1;
+		}
 
-	// Remove socket info from list of sockets
-	if(cmdsocket->prev->next == cmdsocket) {
-		cmdsocket->prev->next = cmdsocket->next;
-	} else {
-		ERROR_OUT("BUG: Socket list is inconsistent: cmdsocket->prev->next != cmdsocket!\n");
-	}
-	if(cmdsocket->next != NULL) {
-		if(cmdsocket->next->prev == cmdsocket) {
-			cmdsocket->next->prev = cmdsocket->prev;
-		} else {
-			ERROR_OUT("BUG: Socket list is inconsistent: cmdsocket->next->prev != cmdsocket!\n");
+		dropped = __atomic_exchange_n(&log_ring.dropped, 0, __ATOMIC_RELAXED);
+		if(dropped) {
+			fprintf(stderr, "\e[0;1m%s:%d: %s():\t%llu log messages were dropped.\e[0m\n",
+					__FILE__, __LINE__, __FUNCTION__, (unsigned long long)dropped);
 		}
-	}
 
-	// Close socket and free resources
-	if(cmdsocket->buf_event != NULL) {
-		bufferevent_free(cmdsocket->buf_event);
-	}
-	if(cmdsocket->buffer != NULL) {
-		evbuffer_free(cmdsocket->buffer);
-	}
-	if(cmdsocket->fd >= 0) {
-		shutdown_cmdsocket(cmdsocket);
-		if(close(cmdsocket->fd)) {
-			ERRNO_OUT("Error closing connection on fd %d", cmdsocket->fd);
+		if(wrote) {
+			fflush(stdout);
+			fflush(stderr);
+		} else if(running) {
+			usleep(1000);
 		}
-	}
-	free(cmdsocket);
-}
+	} while(running || wrote);
 
-static void shutdown_cmdsocket(struct cmdsocket *cmdsocket)
-{
-	if(!cmdsocket->shutdown && shutdown(cmdsocket->fd, SHUT_RDWR)) {
-		ERRNO_OUT("Error shutting down client connection on fd %d", cmdsocket->fd);
-	}
-	cmdsocket->shutdown = 1;
+	return NULL;
 }
 
-static int set_nonblock(int fd)
+// Starts writing log messages from a background thread.  Returns 0 on
+// success, -1 on error (messages are then written directly).
+static int start_async_log(void)
 {
-	int flags;
+	uint64_t i;
 
-	flags = fcntl(fd, F_GETFL);
-	if(flags == -1) {
-		ERRNO_OUT("Error getting flags on fd %d", fd);
+	log_ring.slots = calloc(LOG_RING_SLOTS, sizeof(struct log_slot));
+	if(log_ring.slots == NULL) {
+		ERRNO_OUT("Error allocating log ring");
 		return -1;
 	}
-	flags |= O_NONBLOCK;
-	if(fcntl(fd, F_SETFL, flags)) {
-		ERRNO_OUT("Error setting non-blocking I/O on fd %d", fd);
+	for(i = 0; i < LOG_RING_SLOTS; i++) {
+		log_ring.slots[i].seq = i;
+	}
+
+	log_ring.running = 1;
+	errno = pthread_create(&log_ring.thread, NULL, log_thread, NULL);
+	if(errno) {
+		log_ring.running = 0;
+		ERRNO_OUT("Error starting log thread");
+		free(log_ring.slots);
+		log_ring.slots = NULL;
 		return -1;
 	}
 
 	return 0;
 }
 
-// str must have at least len bytes to copy
-static char *strndup_p(const char *str, size_t len)
+// Writes out any queued messages and goes back to writing messages directly
+static void stop_async_log(void)
 {
-	char *newstr;
-
-	newstr = malloc(len + 1);
-	if(newstr == NULL) {
-		ERRNO_OUT("Error allocating buffer for string duplication");
-		return NULL;
+	if(log_ring.slots == NULL) {
+		return;
 	}
 
-	memcpy(newstr, str, len);
-	newstr[len] = 0;
+	__atomic_store_n(&log_ring.running, 0, __ATOMIC_RELEASE);
+	errno = pthread_join(log_ring.thread, NULL);
+	if(errno) {
+		ERRNO_OUT("Error waiting for log thread to exit");
+		return;
+	}
 
-	return newstr;
+	free(log_ring.slots);
+	log_ring.slots = NULL;
 }
 
-static void send_prompt(struct cmdsocket *cmdsocket)
-{
-	if(evbuffer_add_printf(cmdsocket->buffer, "> ") < 0) {
-		ERROR_OUT("Error sending prompt to client.\n");
-	}
-}
+// Fields are ordered by size so that the structure has no padding, since an
+// idle server may hold millions of them.
+struct cmdsocket {
+	// The event loop that owns this connection
+	struct cmdloop *loop;
 
-static void flush_cmdsocket(struct cmdsocket *cmdsocket)
-{
-	if(bufferevent_write_buffer(cmdsocket->buf_event, cmdsocket->buffer)) {
-		ERROR_OUT("Error sending data to client on fd %d\n", cmdsocket->fd);
-	}
-}
+	// The client's buffered I/O event
+	struct bufferevent *buf_event;
 
-static void process_command(size_t len, char *cmdline, struct cmdsocket *cmdsocket)
-{
-	size_t cmdlen;
-	char *cmd;
-	int i;
+	// The bufferevent created for this cmdsocket in its loop's pool.
+	// buf_event points to it unless the connection uses TLS.
+	struct bufferevent *sock_event;
 
-	// Skip leading whitespace, then find command name
-	cmdline += strspn(cmdline, " \t");
-	cmdlen = strcspn(cmdline, " \t");
-	if(cmdlen == 0) {
-		// The line was empty -- no command was given
-		send_prompt(cmdsocket);
-		return;
-	} else if(len == cmdlen) {
-		// There are no parameters
-		cmd = cmdline;
-		cmdline = "";
-	} else {
-		// There may be parameters
-		cmd = strndup_p(cmdline, cmdlen);
-		cmdline += cmdlen + 1; // Skip first space after command name
-	}
+	// The output collected for the client since it was last flushed, or NULL
+	// if there is none.  Commands write to cmdsocket_output(), which lends
+	// the connection an output buffer from its loop until flush_cmdsocket()
+	// moves the output to the bufferevent, so idle clients don't hold one.
+	struct evbuffer *buffer;
 
-	INFO_OUT("Command received: %s\n", cmd);
+	// Number of bytes at the start of the input buffer that are known not to
+	// contain a line terminator
+	size_t scan_offset;
 
-	// Execute the command, if it is valid
-	for(i = 0; i < ARRAY_SIZE(commands); i++) {
-		if(!strcmp(cmd, commands[i].name)) {
-			INFO_OUT("Running command %s\n", commands[i].name);
-			commands[i].func(cmdsocket, &commands[i], cmdline);
-			break;
-		}
-	}
-	if(i == ARRAY_SIZE(commands)) {
-		ERROR_OUT("Unknown command: %s\n", cmd);
-		evbuffer_add_printf(cmdsocket->buffer, "Unknown command: %s\n", cmd);
-	}
-		
-	send_prompt(cmdsocket);
+	// The cmdsocket's position in its loop's ready queue (or in the throttle
+	// queue, since a throttled socket is never ready)
+	TAILQ_ENTRY(cmdsocket) ready_link;
 
-	if(cmd != cmdline && len != cmdlen) {
-		free(cmd);
-	}
-}
+	// When the client's command token bucket will be full again, if it is
+	// throttled (see throttle_cmdsocket())
+	uint64_t cmd_full;
 
-static void cmd_read(struct bufferevent *buf_event, void *arg)
-{
-	struct cmdsocket *cmdsocket = (struct cmdsocket *)arg;
-	char *cmdline;
-	size_t len;
-	int i;
+	// The offloaded untagged command this client is waiting for, or NULL.
+	// None of the client's other commands are run until it finishes.
+	struct cmdjob *job;
 
-	// Process up to 10 commands at a time
-	for(i = 0; i < 10 && !cmdsocket->shutdown; i++) {
-		cmdline = evbuffer_readline(buf_event->input);
-		if(cmdline == NULL) {
-			// No data, or data has arrived, but no end-of-line was found
-			break;
-		}
-		len = strlen(cmdline);
-	
-		INFO_OUT("Read a line of length %zd from client on fd %d: %s\n", len, cmdsocket->fd, cmdline);
-		process_command(len, cmdline, cmdsocket);
-		free(cmdline);
-	}
+	// The cmdsocket's position in its loop's list of subscribers
+	TAILQ_ENTRY(cmdsocket) sub_link;
 
-	// Send the results to the client
-	flush_cmdsocket(cmdsocket);
-}
+	// When data was last received from the client (in loop->now seconds),
+	// and the cmdsocket's position in its loop's timeout wheel
+	time_t last_active;
+	TAILQ_ENTRY(cmdsocket) wheel_link;
 
-static void cmd_error(struct bufferevent *buf_event, short error, void *arg)
-{
-	struct cmdsocket *cmdsocket = (struct cmdsocket *)arg;
+	// Number of commands run for this client, and the time spent running
+	// them in nanoseconds
+	uint64_t commands;
+	uint64_t busy_ns;
 
-	if(error & EVBUFFER_EOF) {
-		INFO_OUT("Remote host disconnected from fd %d.\n", cmdsocket->fd);
-		cmdsocket->shutdown = 1;
-	} else if(error & EVBUFFER_TIMEOUT) {
-		INFO_OUT("Remote host on fd %d timed out.\n", cmdsocket->fd);
-	} else {
-		ERROR_OUT("A socket error (0x%hx) occurred on fd %d.\n", error, cmdsocket->fd);
-	}
+	// Next unused cmdsocket while this one is in its loop's pool
+	struct cmdsocket *next_free;
 
-	free_cmdsocket(cmdsocket);
-}
+	// The connection's io_uring requests, or NULL if its loop doesn't use
+	// io_uring
+	struct cmdsocket_uring *uring;
 
-static void setup_connection(int sockfd, struct sockaddr_in6 *remote_addr, struct event_base *evloop)
-{
-	struct cmdsocket *cmdsocket;
+	// The file descriptor for this client's socket
+	int fd;
 
-	if(set_nonblock(sockfd)) {
-		ERROR_OUT("Error setting non-blocking I/O on an incoming connection.\n");
-	}
+	// Position of this cmdsocket in its loop's array of open connections
+	uint32_t conn_index;
 
-	// Copy connection info into a command handler info structure
-	cmdsocket = create_cmdsocket(sockfd, remote_addr, evloop);
-	if(cmdsocket == NULL) {
-		close(sockfd);
-		return;
-	}
+	// With --trace, when the oldest of the client's unprocessed input
+	// arrived (the low 32 bits of nsec_now() in microseconds), if stamped
+	// is set
+	uint32_t read_us;
 
-	// Initialize a buffered I/O event
-	cmdsocket->buf_event = bufferevent_new(sockfd, cmd_read, NULL, cmd_error, cmdsocket);
-	if(CHECK_NULL(cmdsocket->buf_event)) {
-		ERROR_OUT("Error initializing buffered I/O event for fd %d.\n", sockfd);
-		free_cmdsocket(cmdsocket);
-		return;
-	}
-	bufferevent_base_set(evloop, cmdsocket->buf_event);
-	bufferevent_settimeout(cmdsocket->buf_event, 60, 0);
-	if(bufferevent_enable(cmdsocket->buf_event, EV_READ)) {
-		ERROR_OUT("Error enabling buffered I/O event for fd %d.\n", sockfd);
-		free_cmdsocket(cmdsocket);
-		return;
-	}
+	// Whether this socket has been shut down
+	unsigned int shutdown:1;
 
-	// Create the outgoing data buffer
-	cmdsocket->buffer = evbuffer_new();
-	if(CHECK_NULL(cmdsocket->buffer)) {
-		ERROR_OUT("Error creating output buffer for fd %d.\n", sockfd);
-		free_cmdsocket(cmdsocket);
-		return;
-	}
+	// The protocol spoken by the client (PROTO_*), decided by the first byte
+	// it sends
+	unsigned int protocol:2;
 
-	send_prompt(cmdsocket);
-	flush_cmdsocket(cmdsocket);
-}
+	// Whether this socket is waiting in its loop's ready queue
+	unsigned int ready:1;
 
-static void cmd_connect(int listenfd, short evtype, void *arg)
-{
-	struct sockaddr_in6 remote_addr;
-	socklen_t addrlen = sizeof(remote_addr);
-	int sockfd;
-	int i;
+	// Whether the client has run commands faster than config.cmd_rate and
+	// is waiting in its loop's throttle queue
+	unsigned int throttled:1;
 
-	if(!(evtype & EV_READ)) {
-		ERROR_OUT("Unknown event type in connect callback: 0x%hx\n", evtype);
-		return;
-	}
-	
-	// Accept and configure incoming connections (up to 10 connections in one go)
-	for(i = 0; i < 10; i++) {
-		sockfd = accept(listenfd, (struct sockaddr *)&remote_addr, &addrlen);
-		if(sockfd < 0) {
-			if(errno != EWOULDBLOCK && errno != EAGAIN) {
-				ERRNO_OUT("Error accepting an incoming connection");
-			}
-			break;
-		}
+	// Whether TCP_CORK is currently set on the socket
+	unsigned int corked:1;
 
-		INFO_OUT("Client connected on fd %d\n", sockfd);
+	// Whether reading and running commands is paused until the client reads
+	// enough of its output (see config.write_high)
+	unsigned int paused:1;
 
-		setup_connection(sockfd, &remote_addr, (struct event_base *)arg);
-	}
-}
+	// Whether the client receives broadcasts
+	unsigned int subscribed:1;
 
-// Used only by signal handler
-static struct event_base *server_loop;
+	// Whether the client connected to a --unix listener
+	unsigned int local:1;
 
-static void sighandler(int signal)
-{
-	INFO_OUT("Received signal %d: %s.  Shutting down.\n", signal, strsignal(signal));
+	// Whether read_us is set
+	unsigned int stamped:1;
 
-	if(event_base_loopexit(server_loop, NULL)) {
-		ERROR_OUT("Error shutting down server\n");
-	}
-}
+	// Number of the client's tagged commands running on worker threads (at
+	// most TAGGED_JOBS), and whether an untagged request is waiting for them
+	unsigned int inflight:9;
+	unsigned int waiting:1;
 
-int main(int argc, char *argv[])
-{
-	struct event_base *evloop;
-	struct event connect_event;
-	
-	unsigned short listenport = 14310;
-	struct sockaddr_in6 local_addr;
-	int listenfd;
+	// Whether the cmdsocket is in its loop's timeout wheel, and in which
+	// slot
+	unsigned int in_wheel:1;
+	unsigned int wheel_slot:11;
+};
 
-	// Set signal handlers
-	sigset_t sigset;
-	sigemptyset(&sigset);
-	struct sigaction siginfo = {
-		.sa_handler = sighandler,
-		.sa_mask = sigset,
-		.sa_flags = SA_RESTART,
-	};
-	sigaction(SIGINT, &siginfo, NULL);
-	sigaction(SIGTERM, &siginfo, NULL);
+// Values for cmdsocket->protocol
+#define PROTO_NEW	0	// Nothing has been received yet
+#define PROTO_LINE	1	// Text commands terminated by CR and/or LF
+#define PROTO_BINARY	2	// Length-prefixed frames (see BIN_MAGIC)
 
-	// Initialize libevent
-	INFO_OUT("libevent version: %s\n", event_get_version());
-	evloop = event_base_new();
-	if(CHECK_NULL(evloop)) {
-		ERROR_OUT("Error initializing event loop.\n");
-		return -1;
-	}
-	server_loop = evloop;
-	INFO_OUT("libevent is using %s for events.\n", event_base_get_method(evloop));
+#ifdef HAVE_IO_URING
 
-	// Initialize socket address
-	memset(&local_addr, 0, sizeof(local_addr));
-	local_addr.sin6_family = AF_INET6;
-	local_addr.sin6_port = htons(listenport);
-	local_addr.sin6_addr = in6addr_any;
+// Size of each loop's submission queue (its completion queue is four times
+// larger), and the number and size of the buffers it provides for reads
+#define URING_ENTRIES	1024
+#define URING_BUFS	1024
+#define URING_BUF_SIZE	4096
 
-	// Begin listening for connections
-	listenfd = socket(AF_INET6, SOCK_STREAM, 0);
-	if(listenfd == -1) {
-		ERRNO_OUT("Error creating listening socket");
-		return -1;
+// Maximum number of output buffer chunks sent at once
+#define URING_IOVS	16
+
+// The low bits of a request's user_data say what the request is; the rest is
+// a pointer to the cmdloop or cmdsocket it belongs to
+#define URING_ACCEPT	1	// Multishot accept (cmdloop)
+#define URING_RECV	2	// Multishot recv (cmdsocket)
+#define URING_SEND	3	// sendmsg() of the output buffer (cmdsocket)
+#define URING_CANCEL	4	// Cancellation of a closed connection's requests (cmdsocket)
+#define URING_IGNORE	5	// Requests whose results don't matter
+#define URING_OP_MASK	7
+
+// A loop's io_uring instance.  Requests are queued during each event loop
+// iteration and submitted together by submit_event, and completions are
+// handled when the ring's file descriptor becomes readable.
+struct uring {
+	int fd;
+
+	// Submission queue.  Entries are filled in at sq_tail, and the
+	// kernel's tail is only moved when they are submitted.
+	unsigned int *sq_khead;
+	unsigned int *sq_ktail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_tail;
+	unsigned int pending;
+	struct io_uring_sqe *sqes;
+
+	// Completion queue
+	unsigned int *cq_khead;
+	unsigned int *cq_ktail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	// The kernel's mappings of the rings
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	// Buffers that the kernel picks from for each read, and the ring
+	// through which they are given back once their data has been copied
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_len;
+	char *bufs;
+	unsigned short buf_tail;
+
+	// Whether the multishot accept on the loop's listening socket is armed
+	int accepting;
+
+	struct event cq_event;
+	struct event submit_event;
+};
+
+// A connection's io_uring requests
+struct cmdsocket_uring {
+	// Requests in flight.  A closed cmdsocket isn't returned to the pool
+	// until they have all completed, since a send may still be using its
+	// output buffer.
+	unsigned int ops;
+
+	// Whether the multishot recv is armed, and whether it is being
+	// cancelled to stop reading
+	int receiving;
+	int cancelling;
+
+	// Whether a send is in flight, and the message being sent (which
+	// points at chunks of the bufferevent's output buffer)
+	int sending;
+	struct msghdr msg;
+	struct iovec iov[URING_IOVS];
+};
+
+#else /* HAVE_IO_URING */
+
+struct cmdsocket_uring {
+	int unused;
+};
+
+#endif /* HAVE_IO_URING */
+
+// A block of cmdsockets allocated at once for a loop's pool
+struct cmdslab {
+	struct cmdslab *next;
+	size_t count;
+	struct cmdsocket_uring *uring;
+	struct cmdsocket sockets[];
+};
+
+// An entry in the connection table, which is indexed by file descriptor
+struct connslot {
+	// The open connection using this file descriptor, or NULL
+	struct cmdsocket *cmdsocket;
+
+	// Incremented each time a new connection gets this file descriptor, so
+	// that ids of closed connections don't match their successors
+	uint32_t generation;
+};
+
+// Counters kept by each event loop.  See STAT_ADD() and STAT_GET().
+struct loopstats {
+	// Connections accepted and closed (the difference is the number open),
+	// and how many of the closed ones timed out
+	uint64_t accepted;
+	uint64_t closed;
+	uint64_t timeouts;
+
+	// Lines (or binary frames) received and their total length including
+	// terminators or headers, commands run (including unknown ones), and
+	// unknown commands
+	uint64_t lines;
+	uint64_t bytes_in;
+	uint64_t commands;
+	uint64_t unknown;
+
+	// Commands handed to the worker threads
+	uint64_t offloaded;
+
+	// Bytes of replies handed to the bufferevents for sending
+	uint64_t bytes_out;
+
+	// Socket errors, failed accepts, and clients disconnected for sending
+	// overlong lines
+	uint64_t errors;
+	uint64_t overlong;
+
+	// Number of times a client was paused for not reading its output, and
+	// the number paused now
+	uint64_t pauses;
+	uint64_t paused;
+
+	// Number of times a client was held back for exceeding --cmd-rate
+	uint64_t throttles;
+
+	// Clients subscribed now, broadcasts sent by clients, and broadcasts
+	// added to a subscriber's output or skipped because the subscriber had
+	// too much unread output
+	uint64_t subscribers;
+	uint64_t broadcasts;
+	uint64_t delivered;
+	uint64_t undelivered;
+
+	// TLS handshakes finished, how many of them resumed a session, and how
+	// many left encryption to the kernel (kTLS)
+	uint64_t tls_handshakes;
+	uint64_t tls_resumed;
+	uint64_t tls_ktls;
+
+	// Bytes held in all of the loop's connection buffers, and in the
+	// connection holding the most, sampled once per second
+	uint64_t buffered;
+	uint64_t buffered_max;
+
+	// Histogram of process_command() times: bucket i counts commands that
+	// took between 2^i and 2^(i+1) nanoseconds
+	uint64_t cmd_ns[STATS_LAT_BUCKETS];
+};
+
+// The time a sampled command spent in each phase of being served, in
+// nanoseconds (saturated at UINT32_MAX).  This is also the record format of
+// --trace-file.
+struct trace_record {
+	// When the command started running (CLOCK_MONOTONIC)
+	uint64_t time_ns;
+
+	// Waiting in the input buffer, from the read that brought the oldest of
+	// the client's unprocessed input (which may be the start of a partial
+	// line) until the command started
+	uint32_t input_ns;
+
+	// Finding the line or frame: the time since the client's previous
+	// command or the start of its turn, so the first line of a batch
+	// carries the scan of the whole batch
+	uint32_t split_ns;
+
+	// Running the command, including the wait for a worker if it was
+	// offloaded
+	uint32_t run_ns;
+
+	// Waiting in the client's output buffer until flush_cmdsocket() handed
+	// the output to the bufferevent
+	uint32_t output_ns;
+
+	// The client's socket and event loop
+	int32_t fd;
+	uint16_t loop;
+
+	// Index of the command in commands[], or TRACE_UNKNOWN
+	uint8_t command;
+
+	// TRACE_* flags
+	uint8_t flags;
+};
+
+#define TRACE_UNKNOWN	0xff	// An unknown command or an empty line
+#define TRACE_BINARY	0x1	// Sent with the binary protocol
+#define TRACE_OFFLOADED	0x2	// Run on a worker thread
+
+// A slot in a loop's trace ring.  seq is odd while the record is being
+// written, and 2 * (position + 1) once it holds the record for that position
+// in the ring, so readers on other threads can tell a torn copy.
+struct trace_slot {
+	uint64_t seq;
+	struct trace_record record;
+};
+
+// The start of a --trace-file, which continues with the name of each command
+// in commands[] (NUL-terminated, in index order) and then the records, all in
+// the server's byte order
+struct trace_header {
+	char magic[8];		// TRACE_MAGIC
+	uint32_t record_size;	// sizeof(struct trace_record)
+	uint32_t commands;	// Number of command names
+	uint64_t records;	// Number of records
+};
+
+#define TRACE_MAGIC	"CLITRC01"
+
+// A sampled command whose trace isn't finished: it is still running (if done
+// is 0) on the loop or as the given job on a worker, or its output hasn't been
+// flushed
+struct trace_pending {
+	struct cmdsocket *cmdsocket;
+	struct cmdjob *job;
+	uint64_t done;
+	struct trace_record record;
+};
+
+// An event loop with its own listening socket and connections.  Each loop
+// runs in its own thread when more than one loop is configured.
+struct cmdloop {
+	// Index of this loop in the loops array
+	int id;
+
+	// This loop's libevent event base
+	struct event_base *evloop;
+
+	// This loop's listening socket and the event that accepts connections
+	int listenfd;
+	struct event connect_event;
+
+	// This loop's copies of the --unix listening sockets (every loop accepts
+	// from each of them) and their events
+	int localfds[MAX_LOCAL_LISTENERS];
+	struct event local_events[MAX_LOCAL_LISTENERS];
+
+	// The loop's io_uring instance if --io-uring was given, which then
+	// accepts connections and does all of their reads and writes
+	struct uring *uring;
+
+	// The thread running this loop (loop 0 runs in the main thread), and
+	// the CPU it is pinned to, or -1
+	pthread_t thread;
+	int cpu;
+
+	// Open connections, packed at the start of an array with room for every
+	// cmdsocket in the pool, so they can be visited without chasing pointers
+	struct cmdsocket **conns;
+	size_t nconns;
+
+	// Connections with complete lines left over after using up their
+	// command budget, and the event that serves them
+	TAILQ_HEAD(cmdsocket_queue, cmdsocket) ready_queue;
+	struct event ready_event;
+
+	// Connections that ran out of command tokens, and the timer that lets
+	// them try again
+	struct cmdsocket_queue throttle_queue;
+	struct event throttle_event;
+
+	// Shares this loop's part of --global-rate among its connections, or
+	// NULL
+	struct bufferevent_rate_limit_group *rate_group;
+
+	// Timeout wheel: each slot holds the connections that are due to time
+	// out at a time equal to the slot's index modulo WHEEL_SLOTS.  now is
+	// the loop's clock in seconds, updated by the once-per-second tick.
+	struct cmdsocket_queue wheel[WHEEL_SLOTS];
+	struct event wheel_event;
+	time_t now;
+
+	// Holds lines that aren't stored contiguously in a client's input buffer
+	// (config.max_line bytes)
+	char *linebuf;
+
+	// Collects the output of one binary protocol command so that its length
+	// is known before it is framed
+	struct evbuffer *reply;
+
+	// The command set this loop's clients use (see LOOP_RELOAD)
+	struct cmdset *cmds;
+
+	// Output buffers waiting to be lent to clients (see cmdsocket_output())
+	struct evbuffer *spare_outputs[SPARE_OUTPUTS];
+	size_t nspare_outputs;
+
+	// With --trace, the ring of TRACE_SLOTS sampled command traces and the
+	// position of the next one (written only by this loop, read by the
+	// trace command on any thread), the number of commands until the next
+	// sample, and the sampled commands whose traces aren't finished
+	struct trace_slot *traces;
+	uint64_t trace_head;
+	size_t trace_countdown;
+	struct trace_pending pending_traces[TRACE_PENDING];
+	size_t npending_traces;
+
+	// Offloaded commands that the workers have finished
+	pthread_mutex_t done_lock;
+	struct cmdjob *done_head;
+	struct cmdjob *done_tail;
+
+	// Clients that receive broadcasts.  Broadcasts from any loop arrive in
+	// the inbox (under inbox_lock), then wait in the fanout queue, whose
+	// head is delivered to BROADCAST_BUDGET subscribers per event loop
+	// iteration by fanout_event.  fanout_next is the head's next
+	// subscriber.
+	struct cmdsocket_queue subscribers;
+	pthread_mutex_t inbox_lock;
+	struct broadcast_link *inbox_head;
+	struct broadcast_link *inbox_tail;
+	struct broadcast_link *fanout_head;
+	struct broadcast_link *fanout_tail;
+	struct cmdsocket *fanout_next;
+	struct event fanout_event;
+
+	// Whether done_lock and inbox_lock were initialized (see free_cmdloop())
+	int locks_ready;
+
+	// LOOP_* requests from other threads, and the eventfd they write to
+	// (see wake_loop()).  Event bases are created without locks, so this
+	// is the only way other threads reach the loop.
+	int requests;
+	int wake_fd;
+	struct event wake_event;
+
+	// Pool of unused cmdsockets, and the slabs they were allocated from
+	struct cmdsocket *free_list;
+	struct cmdslab *slabs;
+	size_t pool_size;
+
+	// This loop's counters, and the event that logs them every
+	// --stats-interval seconds
+	struct loopstats stats;
+	struct event stats_event;
+
+	// Samples the buffer sizes for the stats once per second
+	struct event sample_event;
+
+	// Set once the loop starts draining: it stops accepting, and exits once
+	// its connections have gone idle and been closed (or when
+	// drain_timeout_event fires)
+	int draining;
+	struct event drain_timeout_event;
+};
+
+// Values for cmdloop->requests
+#define LOOP_DRAIN	0x1	// Start draining (see drain_loop())
+#define LOOP_STOP	0x2	// Exit the event loop now
+#define LOOP_RELOAD	0x4	// Switch to the current command set (see reload_func())
+
+// Number of subscribers each loop delivers broadcasts to per event loop
+// iteration, so a large fan-out doesn't hold up the loop's other clients
+#define BROADCAST_BUDGET 256
+
+// One loop's reference to a broadcast, queued in the loop's inbox and then
+// its fanout queue
+struct broadcast_link {
+	struct broadcast_link *next;
+	struct broadcast *broadcast;
+};
+
+// A message sent to every subscriber, built once and added to each
+// subscriber's output by reference.  data holds a binary protocol frame
+// header followed by the text line, so text clients reference the line and
+// binary clients the whole frame.  Each loop's link holds a reference until
+// the loop is done with it, as does every output buffer it was added to;
+// the last one frees it.
+struct broadcast {
+	int refs;
+	size_t len;
+	char *data;
+	struct broadcast_link links[];
+};
+
+// An offloaded command on its way to, running on, or returning from a worker
+// thread.  Unless the command was tagged, the client's later commands wait
+// until the job returns to the client's loop, so its replies stay in order.
+struct cmdjob {
+	struct cmdjob *next;
+
+	// The client that sent the command (only looked at by its loop, which
+	// discards the job if the client has since disconnected), and its id
+	// at the time
+	struct cmdsocket *cmdsocket;
+	uint64_t conn_id;
+	struct cmdloop *loop;
+
+	// The command, and the command set holding it
+	struct command *command;
+	struct cmdset *cmds;
+
+	// The command's output, written by the worker
+	struct evbuffer *output;
+
+	// The request's tag, if it was tagged (see TAG_MAX)
+	size_t taglen;
+	char tag[TAG_MAX];
+
+	// A copy of the command's parameters
+	size_t len;
+	char params[];
+};
+
+// Open-addressed hash table of commands, indexed by a hash of the command
+// name so that finding a command doesn't depend on the number of commands
+struct cmdtable {
+	// Power-of-two sized array of slots; empty slots are NULL
+	struct command **slots;
+	size_t mask;
+};
+
+// A loaded command module (see module.h).  The module is opened through fd,
+// which stays open while it is loaded, so that a module rebuilt at the same
+// path is loaded afresh instead of being matched to the old copy.
+struct module {
+	void *handle;
+	int fd;
+};
+
+// The commands clients can run: commands[] followed by the commands of every
+// --module, their lookup table, and the help text listing them.  Each loop
+// holds a reference to the set it uses, as do its jobs and help replies
+// that haven't been sent, so a set replaced by the reload command is freed
+// (and its modules unloaded) once nothing uses it.
+struct cmdset {
+	int refs;
+
+	struct command *commands;
+	size_t count;
+	struct cmdtable table;
+
+	char *help;
+	size_t help_len;
+
+	struct module modules[MAX_MODULES];
+	size_t nmodules;
+};
+
+static void echo_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void help_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void info_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void quit_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void kill_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void stats_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void resolve_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void broadcast_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void subscribe_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void unsubscribe_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void trace_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+static void reload_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+
+static void shutdown_cmdsocket(struct cmdsocket *cmdsocket);
+static struct cmdsocket *find_cmdsocket(uint64_t id);
+static uint64_t cmdsocket_id(struct cmdsocket *cmdsocket);
+static void stop_server(void);
+static void drain_server(void);
+static int add_static(struct evbuffer *buffer, const char *str, size_t len);
+static void cmd_read(struct bufferevent *buf_event, void *arg);
+static void cmd_write(struct bufferevent *buf_event, void *arg);
+static void cmd_error(struct bufferevent *buf_event, short error, void *arg);
+static void release_cmdsocket(struct cmdsocket *cmdsocket);
+static void trace_flushed(struct cmdsocket *cmdsocket, int discard);
+static void trace_offloaded(struct cmdsocket *cmdsocket, struct cmdjob *job);
+static void tag_reply(struct cmdsocket *cmdsocket, const char *tag, size_t taglen, struct evbuffer *reply);
+static int parse_size(const char *str, size_t min, size_t max, size_t *value);
+static void put_output(struct cmdsocket *cmdsocket);
+static void uring_flush(struct cmdsocket *cmdsocket);
+static int uring_close(struct cmdsocket *cmdsocket);
+static int start_tls(struct cmdsocket *cmdsocket);
+static void close_tls(struct cmdsocket *cmdsocket);
+static void tls_connected(struct cmdsocket *cmdsocket);
+static void tls_info(struct cmdsocket *cmdsocket, struct evbuffer *out);
+static void log_tls_errors(struct bufferevent *buf_event);
+static void uring_cancel_accept(struct cmdloop *loop);
+static int send_broadcast(const char *message, size_t len);
+static void unsubscribe(struct cmdsocket *cmdsocket);
+static void wake_loop(struct cmdloop *loop, int requests);
+static struct cmdset *load_cmdset(void);
+static struct cmdset *get_cmdset(void);
+static void put_cmdset(struct cmdset *set);
+static void put_help(const void *data, size_t len, void *arg);
+
+// add_static() for string literals
+#define ADD_STATIC(buffer, str) add_static((buffer), (str), sizeof(str) - 1)
+
+// Binary protocol clients refer to commands by their position in this list,
+// so new commands must be added at the end.
+static struct command commands[] = {
+	{ "echo", "Prints the command line.", echo_func },
+	{ "help", "Prints a list of commands and their descriptions.", help_func },
+	{ "info", "Prints connection information (for this connection, or the given id).", info_func },
+	{ "quit", "Disconnects from the server.", quit_func },
+	{ "kill", "Shuts down the server.", kill_func },
+	{ "stats", "Prints server statistics.", stats_func },
+	{ "resolve", "Prints the addresses of the given host name.", resolve_func, CMD_OFFLOAD },
+	{ "broadcast", "Sends the given message to every subscribed client.", broadcast_func },
+	{ "subscribe", "Starts receiving broadcasts.", subscribe_func },
+	{ "unsubscribe", "Stops receiving broadcasts.", unsubscribe_func },
+	{ "trace", "Prints sampled command timings (or saves them to the trace file).", trace_func, CMD_OFFLOAD },
+	{ "reload", "Reloads the command modules.", reload_func, CMD_OFFLOAD },
+};
+
+// Server settings that may be changed on the command line
+static struct {
+	// Maximum length of a command line, excluding the line terminator
+	size_t max_line;
+
+	// Number of event loop threads
+	size_t threads;
+
+	// Number of cmdsockets to preallocate for each loop, and the number to
+	// add to a loop's pool each time it runs out
+	size_t pool_size;
+	size_t pool_grow;
+
+	// Seconds without data from a client before it is disconnected (0
+	// disables timeouts)
+	size_t timeout;
+
+	// Maximum number of commands to run for one connection before giving
+	// the other connections on its loop a turn
+	size_t cmd_budget;
+
+	// Maximum number of connections to accept on each listening socket
+	// wakeup
+	size_t accept_budget;
+
+	// Length of each listening socket's queue of connections waiting to be
+	// accepted
+	size_t backlog;
+
+	// Seconds the kernel may hold a new connection until the client sends
+	// data before handing it to the server (TCP_DEFER_ACCEPT), or 0
+	size_t defer_accept;
+
+	// TCP port to listen on (0 for none), and the UNIX sockets to listen on
+	// (paths, or names in the abstract namespace if they start with @)
+	size_t port;
+	const char *unix_paths[MAX_LOCAL_LISTENERS];
+	size_t unix_count;
+
+	// Shared objects to load commands from (see module.h)
+	const char *module_paths[MAX_MODULES];
+	size_t module_count;
+
+	// Whether to set TCP_CORK while a connection has pipelined commands
+	// waiting in the ready queue
+	int cork;
+
+	// Whether to write log messages from a background thread
+	int async_log;
+
+	// CPUs to pin the event loop threads to (loop i runs on cpus[i %
+	// ncpus]), or none if ncpus is 0, and whether to hand each TCP
+	// connection to the loop on the CPU that received it
+	unsigned short cpus[CPU_SETSIZE];
+	size_t ncpus;
+	int steer;
+
+	// Whether to do socket I/O with io_uring instead of libevent
+	int io_uring;
+
+	// PEM files holding the TLS certificate chain and private key, or NULL
+	// to speak plain TCP (the key defaults to the certificate file), and
+	// whether to ask OpenSSL for kernel TLS
+	const char *tls_cert;
+	const char *tls_key;
+	int ktls;
+
+	// Number of worker threads for CMD_OFFLOAD commands (0 runs them on the
+	// event loops like any other command)
+	size_t workers;
+
+	// Seconds between logging each loop's statistics (0 to never log them)
+	size_t stats_interval;
+
+	// Maximum number of bytes read into a client's input buffer before it
+	// is processed (0 for twice the maximum line length)
+	size_t read_high;
+
+	// A client with more than write_high bytes of output waiting is paused
+	// (nothing is read from it and none of its commands are run) until its
+	// output drops to write_low bytes
+	size_t write_high;
+	size_t write_low;
+
+	// Bytes per second that each client may send and receive, and that all
+	// clients together may send and receive (split evenly between the
+	// loops), or 0 for no limit
+	size_t rate;
+	size_t global_rate;
+
+	// Commands per second that each client may run (0 for no limit).  A
+	// client may run up to a second's worth at once after being idle.
+	size_t cmd_rate;
+
+	// Seconds to wait for connections to finish when draining, after which
+	// the remaining connections are closed (0 waits forever)
+	size_t drain_timeout;
+
+	// Path of a UNIX socket used to hand the listening sockets to a
+	// restarted server, or NULL
+	const char *handoff;
+
+	// Trace one in this many commands (0 for none), and the file to write
+	// the traces to on exit and on trace save, or NULL
+	size_t trace;
+	const char *trace_file;
+
+	// Name of the micro-benchmark to run instead of the server, or NULL
+	const char *benchmark;
+} config = {
+	.max_line = 65536,
+	.port = 14310,
+	.timeout = 60,
+	.cmd_budget = 10,
+	.accept_budget = 10,
+	.backlog = SOMAXCONN,
+	.drain_timeout = 30,
+	.write_high = 1048576,
+	.write_low = 262144,
+	.threads = 1,
+	.pool_size = 64,
+	.pool_grow = 64,
+	.workers = 4,
+};
+
+// The server's event loops (config.threads of them)
+static struct cmdloop *loops;
+
+// The current command set, which new loops and reloaded loops use
+static struct {
+	pthread_mutex_t lock;
+	struct cmdset *current;
+} cmdsets = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Open connections on every loop, indexed by file descriptor and sized by the
+// file descriptor limit.  Each entry is only written by the loop that owns
+// the connection using its file descriptor.
+static struct {
+	struct connslot *slots;
+	size_t size;
+} conn_table;
+
+// Whether drain_server() has been called
+static int draining;
+
+// Number of event loop threads (loops other than loop 0) that haven't exited
+static int loops_running;
+
+// Threads running CMD_OFFLOAD commands, and the queue of jobs waiting for
+// them (see offload_command())
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct cmdjob *head;
+	struct cmdjob *tail;
+	int stop;
+
+	pthread_t *threads;
+	size_t count;
+
+	// Number of workers running a command
+	size_t busy;
+} workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+// The UNIX socket that restarted servers connect to for the listening sockets
+// (see --handoff), its event on loop 0, and whether the listening sockets
+// have been handed off
+static struct {
+	int fd;
+	struct event *event;
+	int handed_off;
+} handoff = {
+	.fd = -1,
+};
+
+// Token bucket settings for each client's --rate and for each loop's share
+// of --global-rate, or NULL if there is no limit
+static struct {
+	struct ev_token_bucket_cfg *client;
+	struct ev_token_bucket_cfg *loop;
+} rate_limits;
+
+
+// Returns a monotonic timestamp in nanoseconds
+static uint64_t nsec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void echo_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+	evbuffer_add(out, params, len);
+	evbuffer_add(out, "\n", 1);
+}
+
+static void help_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct cmdset *set = cmdsocket->loop->cmds;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	// The help text goes away with its set, which may be replaced before
+	// the reply is sent
+	__atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+	if(evbuffer_add_reference(out, set->help, set->help_len, put_help, set)) {
+		put_cmdset(set);
+	}
+}
+
+static void info_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct cmdsocket *target = cmdsocket;
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	struct sockaddr_in6 *addr6;
+	char addr[INET6_ADDRSTRLEN];
+	const char *addr_start;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	char idstr[24];
+	char *end;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	if(len > 0) {
+		target = NULL;
+		if(len < sizeof(idstr)) {
+			memcpy(idstr, params, len);
+			idstr[len] = 0;
+			target = find_cmdsocket(strtoull(idstr, &end, 10));
+			if(*end != 0) {
+				target = NULL;
+			}
+		}
+		if(target == NULL) {
+			ADD_STATIC(out, "No such connection: ");
+			evbuffer_add(out, params, len);
+			ADD_STATIC(out, "\n");
+			return;
+		}
+		if(target->loop != cmdsocket->loop) {
+			// Its details belong to another thread
+			evbuffer_add_printf(out, "Connection %.*s is on loop %d\n",
+					LEN_STR(len, params), target->loop->id);
+			return;
+		}
+	}
+
+	evbuffer_add_printf(out, "Connection id: %llu\n", (unsigned long long)cmdsocket_id(target));
+
+	if(getpeername(target->fd, (struct sockaddr *)&peer, &peerlen)) {
+		peer.ss_family = AF_UNSPEC;
+	}
+	switch(peer.ss_family) {
+		case AF_INET6:
+			addr6 = (struct sockaddr_in6 *)&peer;
+			addr_start = inet_ntop(AF_INET6, &addr6->sin6_addr, addr, sizeof(addr));
+			if(addr_start != NULL && !strncmp(addr, "::ffff:", 7) && strchr(addr, '.') != NULL) {
+				addr_start += 7;
+			}
+			evbuffer_add_printf(out, "Client address: %s\nClient port: %hu\n",
+					addr_start != NULL ? addr_start : "unknown", ntohs(addr6->sin6_port));
+			break;
+
+		case AF_UNIX:
+			// Local clients rarely bind an address, but the kernel knows
+			// which process is connected
+			ADD_STATIC(out, "Client address: local\n");
+			if(!getsockopt(target->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) {
+				evbuffer_add_printf(out, "Client process: %d (uid %u, gid %u)\n",
+						(int)cred.pid, (unsigned int)cred.uid, (unsigned int)cred.gid);
+			}
+			break;
+
+		default:
+			ADD_STATIC(out, "Client address: unknown\n");
+			break;
+	}
+
+	evbuffer_add_printf(
+			out,
+			"Commands run: %llu\nCommand time: %llu usec\n",
+			(unsigned long long)target->commands,
+			(unsigned long long)target->busy_ns / 1000
+			);
+	tls_info(target, out);
+}
+
+static void quit_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+	shutdown_cmdsocket(cmdsocket);
+}
+
+static void kill_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	INFO_OUT("Shutting down server.\n");
+
+	// This connection is closed along with the others once its output
+	// (including this command's prompt) has been sent
+	drain_server();
+}
+
+// Returns the upper bound (in nanoseconds) of the command time histogram
+// bucket below which the given fraction of commands fall (or 2 if the
+// histogram is empty)
+static uint64_t cmd_ns_percentile(const uint64_t *buckets, double fraction)
+{
+	uint64_t count = 0, target, seen = 0;
+	int i;
+
+	for(i = 0; i < STATS_LAT_BUCKETS; i++) {
+		count += buckets[i];
+	}
+	target = count * fraction;
+
+	for(i = 0; i < STATS_LAT_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if(seen > target) {
+			break;
+		}
+	}
+
+	return (uint64_t)2 << i;
+}
+
+// Prints the counters of every loop added together, then each loop's
+// connection and command counts.  Other loops' counters are read while they
+// run, so the totals are a close snapshot rather than an exact one.
+static void stats_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct loopstats total;
+	struct cmdloop *loop;
+	int i, j;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	memset(&total, 0, sizeof(total));
+	for(i = 0; i < config.threads; i++) {
+		loop = &loops[i];
+		total.accepted += STAT_GET(loop, accepted);
+		total.closed += STAT_GET(loop, closed);
+		total.timeouts += STAT_GET(loop, timeouts);
+		total.lines += STAT_GET(loop, lines);
+		total.bytes_in += STAT_GET(loop, bytes_in);
+		total.commands += STAT_GET(loop, commands);
+		total.unknown += STAT_GET(loop, unknown);
+		total.offloaded += STAT_GET(loop, offloaded);
+		total.bytes_out += STAT_GET(loop, bytes_out);
+		total.errors += STAT_GET(loop, errors);
+		total.overlong += STAT_GET(loop, overlong);
+		total.pauses += STAT_GET(loop, pauses);
+		total.throttles += STAT_GET(loop, throttles);
+		total.subscribers += STAT_GET(loop, subscribers);
+		total.broadcasts += STAT_GET(loop, broadcasts);
+		total.delivered += STAT_GET(loop, delivered);
+		total.undelivered += STAT_GET(loop, undelivered);
+		total.tls_handshakes += STAT_GET(loop, tls_handshakes);
+		total.tls_resumed += STAT_GET(loop, tls_resumed);
+		total.tls_ktls += STAT_GET(loop, tls_ktls);
+		total.paused += STAT_GET(loop, paused);
+		total.buffered += STAT_GET(loop, buffered);
+		if(STAT_GET(loop, buffered_max) > total.buffered_max) {
+			total.buffered_max = STAT_GET(loop, buffered_max);
+		}
+		for(j = 0; j < STATS_LAT_BUCKETS; j++) {
+			total.cmd_ns[j] += STAT_GET(loop, cmd_ns[j]);
+		}
+	}
+
+	evbuffer_add_printf(out,
+			"Connections: %llu open, %llu accepted, %llu closed, %llu timed out\n"
+			"Lines: %llu (%llu bytes)\n"
+			"Commands: %llu (%llu unknown, %llu offloaded)\n"
+			"Output: %llu bytes\n"
+			"Errors: %llu (%llu overlong lines)\n"
+			"Paused for unread output: %llu now, %llu times\n"
+			"Throttled for command rate: %llu times\n"
+			"Broadcasts: %llu subscribers, %llu sent, %llu delivered, %llu skipped\n"
+			"TLS: %llu handshakes (%llu resumed), %llu with kTLS\n"
+			"Buffered: %llu bytes (%llu per connection, %llu at most)\n"
+			"Connection state: %zu bytes per connection\n"
+			"Command time: p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns\n",
+			(unsigned long long)(total.accepted - total.closed),
+			(unsigned long long)total.accepted,
+			(unsigned long long)total.closed,
+			(unsigned long long)total.timeouts,
+			(unsigned long long)total.lines,
+			(unsigned long long)total.bytes_in,
+			(unsigned long long)total.commands,
+			(unsigned long long)total.unknown,
+			(unsigned long long)total.offloaded,
+			(unsigned long long)total.bytes_out,
+			(unsigned long long)total.errors,
+			(unsigned long long)total.overlong,
+			(unsigned long long)total.paused,
+			(unsigned long long)total.pauses,
+			(unsigned long long)total.throttles,
+			(unsigned long long)total.subscribers,
+			(unsigned long long)total.broadcasts,
+			(unsigned long long)total.delivered,
+			(unsigned long long)total.undelivered,
+			(unsigned long long)total.tls_handshakes,
+			(unsigned long long)total.tls_resumed,
+			(unsigned long long)total.tls_ktls,
+			(unsigned long long)total.buffered,
+			(unsigned long long)(total.accepted > total.closed ? total.buffered / (total.accepted - total.closed) : 0),
+			(unsigned long long)total.buffered_max,
+			sizeof(struct cmdsocket) + sizeof(struct connslot),
+			(unsigned long long)cmd_ns_percentile(total.cmd_ns, 0.5),
+			(unsigned long long)cmd_ns_percentile(total.cmd_ns, 0.99),
+			(unsigned long long)cmd_ns_percentile(total.cmd_ns, 0.999));
+
+	for(i = 0; i < config.threads; i++) {
+		loop = &loops[i];
+		evbuffer_add_printf(out, "Loop %d: %llu open, %llu commands", i,
+				(unsigned long long)(STAT_GET(loop, accepted) - STAT_GET(loop, closed)),
+				(unsigned long long)STAT_GET(loop, commands));
+		if(loop->cpu >= 0) {
+			evbuffer_add_printf(out, " on CPU %d", loop->cpu);
+		}
+		ADD_STATIC(out, "\n");
+	}
+}
+
+// Looks up the host name given as the parameter.  getaddrinfo() may block
+// for seconds waiting for a DNS server, so this command is offloaded.
+static void resolve_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct addrinfo hints, *result, *ai;
+	char host[NI_MAXHOST];
+	char addr[INET6_ADDRSTRLEN];
+	const void *src;
+	int ret;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	if(len == 0 || len >= sizeof(host)) {
+		ADD_STATIC(out, "Usage: resolve HOSTNAME\n");
+		return;
+	}
+	memcpy(host, params, len);
+	host[len] = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host, NULL, &hints, &result);
+	if(ret) {
+		evbuffer_add_printf(out, "Error resolving %s: %s\n", host, gai_strerror(ret));
+		return;
+	}
+
+	for(ai = result; ai != NULL; ai = ai->ai_next) {
+		if(ai->ai_family == AF_INET) {
+			src = &((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+		} else if(ai->ai_family == AF_INET6) {
+			src = &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+		} else {
+			continue;
+		}
+		if(inet_ntop(ai->ai_family, src, addr, sizeof(addr)) != NULL) {
+			evbuffer_add_printf(out, "%s\n", addr);
+		}
+	}
+
+	freeaddrinfo(result);
+}
+
+static void broadcast_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	uint64_t subscribers = 0;
+	int i;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	if(send_broadcast(params, len)) {
+		ADD_STATIC(out, "Error sending broadcast.\n");
+		return;
+	}
+	STAT_ADD(cmdsocket->loop, broadcasts, 1);
+
+	for(i = 0; i < config.threads; i++) {
+		subscribers += STAT_GET(&loops[i], subscribers);
+	}
+	evbuffer_add_printf(out, "Broadcasting to %llu subscribers.\n", (unsigned long long)subscribers);
+}
+
+static void subscribe_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	if(!cmdsocket->subscribed) {
+		TAILQ_INSERT_TAIL(&loop->subscribers, cmdsocket, sub_link);
+		cmdsocket->subscribed = 1;
+		STAT_ADD(loop, subscribers, 1);
+	}
+	ADD_STATIC(out, "Subscribed to broadcasts.\n");
+}
+
+static void unsubscribe_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	unsubscribe(cmdsocket);
+	ADD_STATIC(out, "Unsubscribed from broadcasts.\n");
+}
+
+// Copies the traces in the loop's ring to records, oldest first, skipping any
+// that the loop overwrites while they are being copied.  Returns the number
+// copied (at most TRACE_SLOTS).  May be called from any thread.
+static size_t read_traces(struct cmdloop *loop, struct trace_record *records)
+{
+	struct trace_slot *slot;
+	uint64_t head, pos, seq;
+	size_t count = 0;
+
+	if(loop->traces == NULL) {
+		return 0;
+	}
+
+	head = __atomic_load_n(&loop->trace_head, __ATOMIC_ACQUIRE);
+	for(pos = head > TRACE_SLOTS ? head - TRACE_SLOTS : 0; pos < head; pos++) {
+		slot = &loop->traces[pos & (TRACE_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq != 2 * (pos + 1)) {
+			continue;
+		}
+		records[count] = slot->record;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// Copies every loop's traces to a new array, which the caller must free.
+// Returns the number of traces, or -1 on error.
+static ssize_t collect_traces(struct trace_record **records)
+{
+	size_t count = 0;
+	int i;
+
+	*records = malloc(config.threads * TRACE_SLOTS * sizeof(struct trace_record));
+	if(*records == NULL) {
+		ERRNO_OUT("Error allocating a copy of the traces");
+		return -1;
+	}
+	for(i = 0; i < config.threads; i++) {
+		count += read_traces(&loops[i], *records + count);
+	}
+
+	return count;
+}
+
+// Writes every loop's traces to config.trace_file (see struct trace_header).
+// Returns the number of traces written, or -1 on error.
+static ssize_t write_traces(void)
+{
+	struct trace_header header;
+	struct trace_record *records;
+	struct cmdset *set;
+	ssize_t count;
+	FILE *file;
+	size_t i;
+	int err;
+
+	count = collect_traces(&records);
+	if(count < 0) {
+		return -1;
+	}
+
+	file = fopen(config.trace_file, "wb");
+	if(file == NULL) {
+		ERRNO_OUT("Error opening trace file %s", config.trace_file);
+		free(records);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(struct trace_record);
+	set = get_cmdset();
+	header.commands = set->count;
+	header.records = count;
+	fwrite(&header, sizeof(header), 1, file);
+	for(i = 0; i < set->count; i++) {
+		fwrite(set->commands[i].name, set->commands[i].namelen + 1, 1, file);
+	}
+	put_cmdset(set);
+	fwrite(records, sizeof(struct trace_record), count, file);
+
+	err = ferror(file);
+	if(fclose(file) || err) {
+		ERRNO_OUT("Error writing trace file %s", config.trace_file);
+		count = -1;
+	}
+
+	free(records);
+	return count;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int compare_trace_time(const void *a, const void *b)
+{
+	const struct trace_record *x = a, *y = b;
+
+	return x->time_ns < y->time_ns ? -1 : x->time_ns > y->time_ns;
+}
+
+// Summarizes the traces of every loop: the median, 99th percentile, and
+// maximum time spent in each phase, followed by the most recent traces (10,
+// or the number given).  "trace save" writes them to --trace-file instead.
+static void trace_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} phases[] = {
+		{ "input", offsetof(struct trace_record, input_ns) },
+		{ "split", offsetof(struct trace_record, split_ns) },
+		{ "run", offsetof(struct trace_record, run_ns) },
+		{ "output", offsetof(struct trace_record, output_ns) },
+	};
+	struct trace_record *records, *record;
+	struct cmdset *set;
+	uint32_t *values;
+	char countstr[16] = "";
+	size_t recent = 10;
+	uint64_t now;
+	ssize_t count;
+	size_t i, j;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	if(config.trace == 0) {
+		ADD_STATIC(out, "Tracing is off (see --trace).\n");
+		return;
+	}
+
+	if(len == 4 && !memcmp(params, "save", 4)) {
+		if(config.trace_file == NULL) {
+			ADD_STATIC(out, "There is no trace file (see --trace-file).\n");
+			return;
+		}
+		count = write_traces();
+		if(count < 0) {
+			evbuffer_add_printf(out, "Error writing traces to %s\n", config.trace_file);
+		} else {
+			evbuffer_add_printf(out, "Wrote %zd traces to %s\n", count, config.trace_file);
+		}
+		return;
+	}
+
+	if(len > 0) {
+		if(len < sizeof(countstr)) {
+			memcpy(countstr, params, len);
+			countstr[len] = 0;
+		}
+		if(parse_size(countstr, 0, TRACE_SLOTS, &recent)) {
+			ADD_STATIC(out, "Usage: trace [COUNT | save]\n");
+			return;
+		}
+	}
+
+	count = collect_traces(&records);
+	if(count < 0) {
+		ADD_STATIC(out, "Error reading traces.\n");
+		return;
+	}
+	values = malloc((count + 1) * sizeof(uint32_t));
+	if(values == NULL) {
+		ERRNO_OUT("Error allocating trace statistics");
+		ADD_STATIC(out, "Error reading traces.\n");
+		free(records);
+		return;
+	}
+
+	evbuffer_add_printf(out, "Tracing 1 in %zu commands, %zd traces kept\n", config.trace, count);
+	if(count > 0) {
+		evbuffer_add_printf(out, "%-8s %12s %12s %12s\n", "Phase", "p50 ns", "p99 ns", "max ns");
+		for(j = 0; j < ARRAY_SIZE(phases); j++) {
+			for(i = 0; i < count; i++) {
+				values[i] = *(const uint32_t *)((const char *)&records[i] + phases[j].offset);
+			}
+			qsort(values, count, sizeof(uint32_t), compare_u32);
+			evbuffer_add_printf(out, "%-8s %12u %12u %12u\n", phases[j].name,
+					values[count / 2], values[count * 99 / 100], values[count - 1]);
+		}
+	}
+
+	// Newest first.  Commands are named from the current set.
+	qsort(records, count, sizeof(struct trace_record), compare_trace_time);
+	now = nsec_now();
+	set = get_cmdset();
+	for(i = count; i > 0 && recent > 0; i--, recent--) {
+		record = &records[i - 1];
+		evbuffer_add_printf(out,
+				"%s on loop %u, fd %d%s%s, %llu ms ago: input %u ns, split %u ns, run %u ns, output %u ns\n",
+				record->command < set->count ? set->commands[record->command].name : "(unknown)",
+				(unsigned int)record->loop, (int)record->fd,
+				(record->flags & TRACE_BINARY) ? ", binary" : "",
+				(record->flags & TRACE_OFFLOADED) ? ", offloaded" : "",
+				(unsigned long long)(now - record->time_ns) / 1000000,
+				record->input_ns, record->split_ns, record->run_ns, record->output_ns);
+	}
+	put_cmdset(set);
+
+	free(values);
+	free(records);
+}
+
+static void reload_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct cmdset *set, *old;
+	size_t i;
+
+	DEBUG_OUT("%s %.*s\n", command->name, LEN_STR(len, params));
+
+	set = load_cmdset();
+	if(set == NULL) {
+		ADD_STATIC(out, "Error reloading modules (see the server log); the old commands are still in use.\n");
+		return;
+	}
+
+	pthread_mutex_lock(&cmdsets.lock);
+	old = cmdsets.current;
+	cmdsets.current = set;
+	pthread_mutex_unlock(&cmdsets.lock);
+	put_cmdset(old);
+
+	// Each loop switches to the new set between callbacks, so commands
+	// only ever see one set
+	for(i = 0; i < config.threads; i++) {
+		wake_loop(&loops[i], LOOP_RELOAD);
+	}
+
+	INFO_OUT("Reloaded %zu commands from %zu modules.\n", set->count - ARRAY_SIZE(commands), set->nmodules);
+	evbuffer_add_printf(out, "Reloaded %zu commands from %zu modules.\n", set->count - ARRAY_SIZE(commands), set->nmodules);
+}
+
+// FNV-1a hash of the len bytes at name
+static uint32_t hash_name(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// Fills in the given table with the count commands in cmds.  Returns 0 on
+// success, -1 on error (including a duplicated command name).
+static int build_cmdtable(struct cmdtable *table, struct command *cmds, size_t count)
+{
+	size_t size, idx;
+	size_t i;
+
+	// Keep the table at most half full so probe sequences stay short
+	for(size = 8; size < count * 2; size *= 2);
+
+	table->slots = calloc(size, sizeof(struct command *));
+	if(table->slots == NULL) {
+		ERRNO_OUT("Error allocating command table");
+		return -1;
+	}
+	table->mask = size - 1;
+
+	for(i = 0; i < count; i++) {
+		cmds[i].namelen = strlen(cmds[i].name);
+
+		idx = hash_name(cmds[i].name, cmds[i].namelen) & table->mask;
+		while(table->slots[idx] != NULL) {
+			if(!strcmp(table->slots[idx]->name, cmds[i].name)) {
+				ERROR_OUT("Command %s is defined more than once.\n", cmds[i].name);
+				free(table->slots);
+				table->slots = NULL;
+				return -1;
+			}
+			idx = (idx + 1) & table->mask;
+		}
+		table->slots[idx] = &cmds[i];
+	}
+
+	return 0;
+}
+
+static void free_cmdtable(struct cmdtable *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+}
+
+// Returns the command whose name is the len bytes at name (which need not be
+// NUL-terminated), or NULL if there is no such command.
+static struct command *find_command(const struct cmdtable *table, const char *name, size_t len)
+{
+	struct command *command;
+	size_t idx;
+
+	idx = hash_name(name, len) & table->mask;
+	while((command = table->slots[idx]) != NULL) {
+		if(command->namelen == len && !memcmp(command->name, name, len)) {
+			return command;
+		}
+		idx = (idx + 1) & table->mask;
+	}
+
+	return NULL;
+}
+
+// Renders the set's help text.  Must be called after the set's command table
+// is built.  Returns 0 on success, -1 on error.
+static int build_help(struct cmdset *set)
+{
+	struct command *cmd;
+	size_t desclen;
+	char *pos;
+	size_t i;
+
+	set->help_len = 0;
+	for(i = 0; i < set->count; i++) {
+		set->help_len += set->commands[i].namelen + strlen(set->commands[i].desc) + 3;
+	}
+
+	set->help = malloc(set->help_len);
+	if(set->help == NULL) {
+		ERRNO_OUT("Error allocating help text");
+		return -1;
+	}
+
+	// Each line is "name:\tdescription\n"
+	pos = set->help;
+	for(i = 0; i < set->count; i++) {
+		cmd = &set->commands[i];
+		desclen = strlen(cmd->desc);
+		memcpy(pos, cmd->name, cmd->namelen);
+		pos += cmd->namelen;
+		*pos++ = ':';
+		*pos++ = '\t';
+		memcpy(pos, cmd->desc, desclen);
+		pos += desclen;
+		*pos++ = '\n';
+	}
+
+	return 0;
+}
+
+// Loads the module at path.  Returns its commands (ended by one with a NULL
+// name) on success, or NULL on error.
+static struct command *load_module(const char *path, struct module *module)
+{
+	struct command *cmds;
+	const int *version;
+	char name[32];
+	size_t i;
+
+	module->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(module->fd < 0) {
+		ERRNO_OUT("Error opening module %s", path);
+		return NULL;
+	}
+
+	snprintf(name, sizeof(name), "/proc/self/fd/%d", module->fd);
+	module->handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+	if(module->handle == NULL) {
+		ERROR_OUT("Error loading module %s: %s\n", path, dlerror());
+		close(module->fd);
+		return NULL;
+	}
+
+	version = dlsym(module->handle, "module_version");
+	cmds = dlsym(module->handle, "module_commands");
+	if(version == NULL || cmds == NULL) {
+		ERROR_OUT("Module %s doesn't export module_version and module_commands.\n", path);
+	} else if(*version != MODULE_VERSION) {
+		ERROR_OUT("Module %s is for version %d of the module interface, not %d.\n", path, *version, MODULE_VERSION);
+	} else {
+		for(i = 0; cmds[i].name != NULL; i++) {
+			if(cmds[i].name[0] == 0 || cmds[i].desc == NULL || cmds[i].func == NULL || (cmds[i].flags & ~CMD_OFFLOAD)) {
+				ERROR_OUT("Module %s has an invalid entry for command %zu.\n", path, i);
+				break;
+			}
+		}
+		if(cmds[i].name == NULL) {
+			return cmds;
+		}
+	}
+
+	dlclose(module->handle);
+	close(module->fd);
+	return NULL;
+}
+
+// Frees the given command set, and unloads its modules
+static void free_cmdset(struct cmdset *set)
+{
+	size_t i;
+
+	free_cmdtable(&set->table);
+	free(set->help);
+	free(set->commands);
+	for(i = 0; i < set->nmodules; i++) {
+		if(dlclose(set->modules[i].handle)) {
+			ERROR_OUT("Error unloading module %s: %s\n", config.module_paths[i], dlerror());
+		}
+		close(set->modules[i].fd);
+	}
+	free(set);
+}
+
+// Builds a command set from commands[] and the commands of every --module.
+// Returns the set, with one reference, or NULL on error.
+static struct cmdset *load_cmdset(void)
+{
+	struct command *cmds[MAX_MODULES];
+	struct cmdset *set;
+	size_t count = ARRAY_SIZE(commands);
+	size_t i, j;
+
+	set = calloc(1, sizeof(struct cmdset));
+	if(set == NULL) {
+		ERRNO_OUT("Error allocating a command set");
+		return NULL;
+	}
+	set->refs = 1;
+
+	for(i = 0; i < config.module_count; i++) {
+		cmds[i] = load_module(config.module_paths[i], &set->modules[i]);
+		if(cmds[i] == NULL) {
+			free_cmdset(set);
+			return NULL;
+		}
+		set->nmodules++;
+		for(j = 0; cmds[i][j].name != NULL; j++, count++);
+	}
+
+	// The built-in commands keep their binary protocol numbers, and each
+	// module's commands follow in the order the modules were given
+	set->commands = malloc(count * sizeof(struct command));
+	if(set->commands == NULL) {
+		ERRNO_OUT("Error allocating %zu commands", count);
+		free_cmdset(set);
+		return NULL;
+	}
+	memcpy(set->commands, commands, sizeof(commands));
+	set->count = ARRAY_SIZE(commands);
+	for(i = 0; i < set->nmodules; i++) {
+		for(j = 0; cmds[i][j].name != NULL; j++) {
+			set->commands[set->count++] = cmds[i][j];
+		}
+	}
+
+	if(build_cmdtable(&set->table, set->commands, set->count) || build_help(set)) {
+		free_cmdset(set);
+		return NULL;
+	}
+
+	return set;
+}
+
+// Returns a new reference to the current command set
+static struct cmdset *get_cmdset(void)
+{
+	struct cmdset *set;
+
+	pthread_mutex_lock(&cmdsets.lock);
+	set = cmdsets.current;
+	__atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cmdsets.lock);
+
+	return set;
+}
+
+// Drops a reference to a command set, freeing it if it was the last.  Safe
+// to call from any thread.
+static void put_cmdset(struct cmdset *set)
+{
+	if(__atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		DEBUG_OUT("Freeing a command set with %zu modules.\n", set->nmodules);
+		free_cmdset(set);
+	}
+}
+
+// Drops the reference a help reply holds to its command set, once libevent
+// is done with the reply (an evbuffer reference cleanup function)
+static void put_help(const void *data, size_t len, void *arg)
+{
+	put_cmdset(arg);
+}
+
+// Adds the given cmdsocket to its loop's array of open connections and to the
+// connection table, which gives it a new id.
+static void add_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct connslot *slot;
+	uint32_t generation = 0;
+
+	cmdsocket->conn_index = loop->nconns;
+	loop->conns[loop->nconns++] = cmdsocket;
+
+	if((size_t)cmdsocket->fd < conn_table.size) {
+		slot = &conn_table.slots[cmdsocket->fd];
+		generation = slot->generation + 1;
+		__atomic_store_n(&slot->generation, generation, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->cmdsocket, cmdsocket, __ATOMIC_RELEASE);
+	}
+}
+
+// Returns the connection's id (see find_cmdsocket())
+static uint64_t cmdsocket_id(struct cmdsocket *cmdsocket)
+{
+	uint32_t generation = 0;
+
+	if((size_t)cmdsocket->fd < conn_table.size) {
+		generation = __atomic_load_n(&conn_table.slots[cmdsocket->fd].generation, __ATOMIC_RELAXED);
+	}
+
+	return (uint64_t)generation << 32 | (uint32_t)cmdsocket->fd;
+}
+
+// Removes the given cmdsocket from its loop's array of open connections (by
+// moving the last one into its place) and from the connection table.
+static void remove_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct cmdsocket *last;
+
+	if(cmdsocket->conn_index >= loop->nconns || loop->conns[cmdsocket->conn_index] != cmdsocket) {
+		ERROR_OUT("BUG: Connection array is inconsistent for fd %d!\n", cmdsocket->fd);
+		return;
+	}
+	last = loop->conns[--loop->nconns];
+	loop->conns[cmdsocket->conn_index] = last;
+	last->conn_index = cmdsocket->conn_index;
+
+	if((size_t)cmdsocket->fd < conn_table.size) {
+		__atomic_store_n(&conn_table.slots[cmdsocket->fd].cmdsocket, NULL, __ATOMIC_RELEASE);
+	}
+}
+
+// Returns the open connection with the given id, or NULL if the connection
+// has closed.  A connection found this way may only be used from its own
+// loop's thread; from other threads only its loop field may be read.
+static struct cmdsocket *find_cmdsocket(uint64_t id)
+{
+	struct cmdsocket *cmdsocket;
+	struct connslot *slot;
+	uint32_t fd = id & 0xffffffff;
+
+	if(fd >= conn_table.size) {
+		return NULL;
+	}
+	slot = &conn_table.slots[fd];
+	cmdsocket = __atomic_load_n(&slot->cmdsocket, __ATOMIC_ACQUIRE);
+	if(cmdsocket == NULL || __atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != id >> 32) {
+		return NULL;
+	}
+
+	return cmdsocket;
+}
+
+// Adds count new cmdsockets, with their bufferevents, to the loop's pool.
+// Returns 0 on success, -1 if nothing could be added.
+static int grow_pool(struct cmdloop *loop, size_t count)
+{
+	struct cmdsocket *cmdsocket;
+	struct cmdsocket **conns;
+	struct cmdslab *slab;
+	size_t i;
+
+	// Make sure the connection array can hold the whole pool
+	conns = realloc(loop->conns, (loop->pool_size + count) * sizeof(struct cmdsocket *));
+	if(conns == NULL) {
+		ERRNO_OUT("Error allocating connection array for loop %d", loop->id);
+		return -1;
+	}
+	loop->conns = conns;
+
+	slab = calloc(1, sizeof(struct cmdslab) + count * sizeof(struct cmdsocket));
+	if(slab == NULL) {
+		ERRNO_OUT("Error allocating %zu command handlers for loop %d", count, loop->id);
+		return -1;
+	}
+	if(loop->uring != NULL) {
+		slab->uring = calloc(count, sizeof(struct cmdsocket_uring));
+		if(slab->uring == NULL) {
+			ERRNO_OUT("Error allocating %zu command handlers for loop %d", count, loop->id);
+			free(slab);
+			return -1;
+		}
+	}
+	slab->next = loop->slabs;
+	loop->slabs = slab;
+
+	for(i = 0; i < count; i++) {
+		cmdsocket = &slab->sockets[i];
+		cmdsocket->fd = -1;
+		cmdsocket->loop = loop;
+		cmdsocket->uring = slab->uring != NULL ? &slab->uring[i] : NULL;
+
+		cmdsocket->buf_event = bufferevent_socket_new(loop->evloop, -1, 0);
+		cmdsocket->sock_event = cmdsocket->buf_event;
+		if(CHECK_NULL(cmdsocket->buf_event)) {
+			ERROR_OUT("Error initializing buffers for command handler pool on loop %d.\n", loop->id);
+			break;
+		}
+		bufferevent_setcb(cmdsocket->buf_event, cmd_read, cmd_write, cmd_error, cmdsocket);
+
+		// libevent stops reading once read_high bytes are waiting, and
+		// calls cmd_write() each time output drops to write_low bytes
+		bufferevent_setwatermark(cmdsocket->buf_event, EV_READ, 0, config.read_high);
+		bufferevent_setwatermark(cmdsocket->buf_event, EV_WRITE, config.write_low, 0);
+
+		// With io_uring, the bufferevent only holds the buffers, which
+		// libevent otherwise freezes for its own socket reads and writes
+		if(loop->uring != NULL) {
+			bufferevent_disable(cmdsocket->buf_event, EV_READ | EV_WRITE);
+			evbuffer_unfreeze(bufferevent_get_input(cmdsocket->buf_event), 0);
+			evbuffer_unfreeze(bufferevent_get_output(cmdsocket->buf_event), 1);
+		}
+
+		cmdsocket->next_free = loop->free_list;
+		loop->free_list = cmdsocket;
+	}
+
+	// Only fully initialized entries are counted
+	slab->count = i;
+	loop->pool_size += i;
+
+	return i == 0 ? -1 : 0;
+}
+
+static void free_pool(struct cmdloop *loop)
+{
+	struct cmdslab *slab;
+	size_t i;
+
+	while(loop->slabs != NULL) {
+		slab = loop->slabs;
+		loop->slabs = slab->next;
+
+		for(i = 0; i < slab->count; i++) {
+			if(slab->sockets[i].buf_event != slab->sockets[i].sock_event) {
+				bufferevent_free(slab->sockets[i].buf_event);
+			}
+			bufferevent_free(slab->sockets[i].sock_event);
+			if(slab->sockets[i].buffer != NULL) {
+				evbuffer_free(slab->sockets[i].buffer);
+			}
+		}
+		free(slab->uring);
+		free(slab);
+	}
+
+	free(loop->conns);
+	loop->conns = NULL;
+	loop->nconns = 0;
+	loop->free_list = NULL;
+	loop->pool_size = 0;
+}
+
+// Returns the seconds counter used for idle timeouts
+static time_t wheel_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+// Puts the cmdsocket in the timeout wheel slot for its idle deadline
+static void wheel_insert(struct cmdsocket *cmdsocket)
+{
+	cmdsocket->wheel_slot = (cmdsocket->last_active + config.timeout) & (WHEEL_SLOTS - 1);
+	TAILQ_INSERT_TAIL(&cmdsocket->loop->wheel[cmdsocket->wheel_slot], cmdsocket, wheel_link);
+	cmdsocket->in_wheel = 1;
+}
+
+static void wheel_remove(struct cmdsocket *cmdsocket)
+{
+	TAILQ_REMOVE(&cmdsocket->loop->wheel[cmdsocket->wheel_slot], cmdsocket, wheel_link);
+	cmdsocket->in_wheel = 0;
+}
+
+static struct cmdsocket *create_cmdsocket(int sockfd, int local, struct cmdloop *loop)
+{
+	struct cmdsocket *cmdsocket;
+
+	if(loop->free_list == NULL && grow_pool(loop, config.pool_grow)) {
+		return NULL;
+	}
+	cmdsocket = loop->free_list;
+	loop->free_list = cmdsocket->next_free;
+
+	cmdsocket->fd = sockfd;
+	cmdsocket->shutdown = 0;
+	cmdsocket->local = local;
+	cmdsocket->stamped = 0;
+	cmdsocket->scan_offset = 0;
+	cmdsocket->protocol = PROTO_NEW;
+	cmdsocket->corked = 0;
+	cmdsocket->paused = 0;
+	cmdsocket->job = NULL;
+	cmdsocket->subscribed = 0;
+	cmdsocket->throttled = 0;
+	cmdsocket->cmd_full = 0;
+	cmdsocket->commands = 0;
+	cmdsocket->busy_ns = 0;
+
+	cmdsocket->last_active = loop->now;
+	if(config.timeout) {
+		wheel_insert(cmdsocket);
+	}
+
+	add_cmdsocket(cmdsocket);
+	STAT_ADD(loop, accepted, 1);
+
+	return cmdsocket;
+}
+
+// Removes the given cmdsocket from its loop's connections, closes its socket,
+// and returns it to the loop's pool with empty buffers.
+static void free_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop;
+
+	if(CHECK_NULL(cmdsocket)) {
+		abort();
+	}
+	loop = cmdsocket->loop;
+
+	// The fd must leave the connection table before it is closed and can be
+	// reused by another loop
+	remove_cmdsocket(cmdsocket);
+
+	if(cmdsocket->ready) {
+		TAILQ_REMOVE(&loop->ready_queue, cmdsocket, ready_link);
+		cmdsocket->ready = 0;
+	}
+	if(cmdsocket->throttled) {
+		TAILQ_REMOVE(&loop->throttle_queue, cmdsocket, ready_link);
+		cmdsocket->throttled = 0;
+	}
+	unsubscribe(cmdsocket);
+
+	if(cmdsocket->in_wheel) {
+		wheel_remove(cmdsocket);
+	}
+
+	if(cmdsocket->paused) {
+		STAT_ADD(loop, paused, -1);
+		cmdsocket->paused = 0;
+	}
+
+	// Jobs that are still running are discarded when they come back, and so
+	// are unfinished traces
+	cmdsocket->job = NULL;
+	cmdsocket->inflight = 0;
+	cmdsocket->waiting = 0;
+	if(loop->npending_traces > 0) {
+		trace_flushed(cmdsocket, 1);
+	}
+
+	// Detach the buffered I/O event from the socket and discard any
+	// unprocessed input.  The next client starts with full rate limit
+	// buckets.  A TLS bufferevent is freed instead, and takes the socket
+	// with it.
+	if(cmdsocket->buf_event != cmdsocket->sock_event) {
+		close_tls(cmdsocket);
+	} else if(cmdsocket->uring == NULL) {
+		bufferevent_disable(cmdsocket->buf_event, EV_READ | EV_WRITE);
+		bufferevent_setfd(cmdsocket->buf_event, -1);
+	}
+	if(loop->rate_group != NULL) {
+		bufferevent_remove_from_rate_limit_group(cmdsocket->buf_event);
+	}
+	if(rate_limits.client != NULL) {
+		bufferevent_set_rate_limit(cmdsocket->buf_event, NULL);
+	}
+	evbuffer_drain(bufferevent_get_input(cmdsocket->buf_event), evbuffer_get_length(bufferevent_get_input(cmdsocket->buf_event)));
+	put_output(cmdsocket);
+
+	// Close socket
+	STAT_ADD(loop, closed, 1);
+	if(cmdsocket->fd >= 0) {
+		shutdown_cmdsocket(cmdsocket);
+		if(close(cmdsocket->fd)) {
+			ERRNO_OUT("Error closing connection on fd %d", cmdsocket->fd);
+		}
+		cmdsocket->fd = -1;
+	}
+
+	// A send may still be using the output buffer, in which case the
+	// cmdsocket goes back to the pool once the kernel is done with it
+	if(cmdsocket->uring == NULL || !uring_close(cmdsocket)) {
+		release_cmdsocket(cmdsocket);
+	}
+
+	if(loop->draining && loop->nconns == 0) {
+		INFO_OUT("Event loop %d has finished draining.\n", loop->id);
+		event_base_loopexit(loop->evloop, NULL);
+	}
+}
+
+// Discards the unsent output of a closed cmdsocket and returns it to its
+// loop's pool.
+static void release_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+
+	evbuffer_drain(bufferevent_get_output(cmdsocket->buf_event), evbuffer_get_length(bufferevent_get_output(cmdsocket->buf_event)));
+
+	cmdsocket->next_free = loop->free_list;
+	loop->free_list = cmdsocket;
+}
+
+// Closes the connection if its loop is draining and it is idle: no input is
+// waiting to be read or processed, no offloaded command is running, and no
+// output is left to send.  Returns 1
+// if the cmdsocket was freed, 0 otherwise.
+static int drain_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	char c;
+
+	if(!cmdsocket->loop->draining || cmdsocket->ready || cmdsocket->job != NULL || cmdsocket->inflight ||
+			(cmdsocket->buffer != NULL && evbuffer_get_length(cmdsocket->buffer)) ||
+			evbuffer_get_length(bufferevent_get_input(cmdsocket->buf_event)) ||
+			evbuffer_get_length(bufferevent_get_output(cmdsocket->buf_event))) {
+		return 0;
+	}
+
+	// Closing a socket with unread data resets the connection, so let a
+	// command that is already on its way be read and answered first
+	if(!cmdsocket->shutdown && recv(cmdsocket->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+		return 0;
+	}
+
+	DEBUG_OUT("Closing drained connection on fd %d.\n", cmdsocket->fd);
+	free_cmdsocket(cmdsocket);
+	return 1;
+}
+
+static void shutdown_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	if(!cmdsocket->shutdown && shutdown(cmdsocket->fd, SHUT_RDWR)) {
+		ERRNO_OUT("Error shutting down client connection on fd %d", cmdsocket->fd);
+	}
+	cmdsocket->shutdown = 1;
+}
+
+static int set_nonblock(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if(flags == -1) {
+		ERRNO_OUT("Error getting flags on fd %d", fd);
+		return -1;
+	}
+	flags |= O_NONBLOCK;
+	if(fcntl(fd, F_SETFL, flags)) {
+		ERRNO_OUT("Error setting non-blocking I/O on fd %d", fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Adds len bytes of a string that is never modified or freed (such as a
+// string literal) to the given output buffer.  Returns 0 on success, -1 on
+// error.
+static int add_static(struct evbuffer *buffer, const char *str, size_t len)
+{
+	if(len >= STATIC_REF_MIN) {
+		return evbuffer_add_reference(buffer, str, len, NULL, NULL);
+	}
+	return evbuffer_add(buffer, str, len);
+}
+
+// Returns the client's output buffer, lending it one of its loop's spare
+// buffers if it has no output waiting to be flushed.  Returns NULL, and shuts
+// the client down, if a buffer can't be allocated.
+static struct evbuffer *cmdsocket_output(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+
+	if(cmdsocket->buffer != NULL) {
+		return cmdsocket->buffer;
+	}
+
+	if(loop->nspare_outputs > 0) {
+		cmdsocket->buffer = loop->spare_outputs[--loop->nspare_outputs];
+	} else {
+		cmdsocket->buffer = evbuffer_new();
+		if(CHECK_NULL(cmdsocket->buffer)) {
+			ERROR_OUT("Error allocating output buffer for fd %d; closing the connection.\n", cmdsocket->fd);
+			shutdown_cmdsocket(cmdsocket);
+			return NULL;
+		}
+	}
+
+	return cmdsocket->buffer;
+}
+
+// Discards anything left in the client's output buffer and returns the buffer
+// to its loop's spares (or frees it, if the loop has enough)
+static void put_output(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+
+	if(cmdsocket->buffer == NULL) {
+		return;
+	}
+
+	evbuffer_drain(cmdsocket->buffer, evbuffer_get_length(cmdsocket->buffer));
+	if(loop->nspare_outputs < SPARE_OUTPUTS) {
+		loop->spare_outputs[loop->nspare_outputs++] = cmdsocket->buffer;
+	} else {
+		evbuffer_free(cmdsocket->buffer);
+	}
+	cmdsocket->buffer = NULL;
+}
+
+static void send_prompt(struct cmdsocket *cmdsocket)
+{
+	struct evbuffer *output = cmdsocket_output(cmdsocket);
+
+	if(output != NULL && ADD_STATIC(output, "> ")) {
+		ERROR_OUT("Error sending prompt to client.\n");
+	}
+}
+
+// Moves the contents of the client's output buffer to its bufferevent, which
+// writes them out when the socket is next writable, and gives the emptied
+// buffer back to the loop.  Buffer chunks are moved rather than copied.
+static void flush_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	size_t len;
+
+	if(cmdsocket->buffer != NULL) {
+		len = evbuffer_get_length(cmdsocket->buffer);
+		if(len > 0) {
+			STAT_ADD(cmdsocket->loop, bytes_out, len);
+			if(bufferevent_write_buffer(cmdsocket->buf_event, cmdsocket->buffer)) {
+				ERROR_OUT("Error sending data to client on fd %d\n", cmdsocket->fd);
+			}
+		}
+		if(evbuffer_get_length(cmdsocket->buffer) == 0) {
+			put_output(cmdsocket);
+		}
+	}
+
+	if(cmdsocket->loop->npending_traces > 0) {
+		trace_flushed(cmdsocket, 0);
+	}
+
+	// With io_uring, this is when the connection's reads and writes are
+	// queued
+	if(cmdsocket->uring != NULL) {
+		uring_flush(cmdsocket);
+	}
+}
+
+// Sets or clears TCP_CORK on the client's socket if --cork was given and the
+// client is connected over TCP
+static void cork_cmdsocket(struct cmdsocket *cmdsocket, int cork)
+{
+	if(!config.cork || cmdsocket->corked == cork || cmdsocket->shutdown || cmdsocket->local) {
+		return;
+	}
+	if(setsockopt(cmdsocket->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork))) {
+		ERRNO_OUT("Error %s TCP_CORK on fd %d", cork ? "setting" : "clearing", cmdsocket->fd);
+		return;
+	}
+	cmdsocket->corked = cork;
+}
+
+static void free_job(struct cmdjob *job)
+{
+	evbuffer_free(job->output);
+	put_cmdset(job->cmds);
+	free(job);
+}
+
+// Queues the command for the worker threads.  Unless the request was tagged,
+// the client's later commands are held back until it finishes.  Returns 0 on
+// success, -1 on error.
+static int offload_command(struct cmdsocket *cmdsocket, struct command *command, const char *params, size_t len,
+		const char *tag, size_t taglen)
+{
+	struct cmdjob *job;
+
+	job = malloc(sizeof(struct cmdjob) + len);
+	if(job == NULL) {
+		ERRNO_OUT("Error allocating job for client on fd %d", cmdsocket->fd);
+		return -1;
+	}
+	job->output = evbuffer_new();
+	if(CHECK_NULL(job->output)) {
+		free(job);
+		return -1;
+	}
+	job->next = NULL;
+	job->cmdsocket = cmdsocket;
+	job->loop = cmdsocket->loop;
+	job->command = command;
+	job->cmds = cmdsocket->loop->cmds;
+	__atomic_add_fetch(&job->cmds->refs, 1, __ATOMIC_RELAXED);
+	job->taglen = taglen;
+	if(taglen) {
+		memcpy(job->tag, tag, taglen);
+	}
+	job->len = len;
+	memcpy(job->params, params, len);
+
+	pthread_mutex_lock(&workers.lock);
+	if(workers.tail != NULL) {
+		workers.tail->next = job;
+	} else {
+		workers.head = job;
+	}
+	workers.tail = job;
+	pthread_cond_signal(&workers.wake);
+	pthread_mutex_unlock(&workers.lock);
+
+	if(taglen) {
+		job->conn_id = cmdsocket_id(cmdsocket);
+		cmdsocket->inflight++;
+	} else {
+		cmdsocket->job = job;
+	}
+	if(cmdsocket->loop->npending_traces > 0) {
+		trace_offloaded(cmdsocket, job);
+	}
+	STAT_ADD(cmdsocket->loop, offloaded, 1);
+
+	return 0;
+}
+
+// Runs the command with its output going to out, or hands it to the worker
+// threads if it is flagged CMD_OFFLOAD.  Returns 1 if the command was
+// offloaded (its output arrives in complete_job()), 0 if it has already run.
+static int run_command(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command,
+		const char *params, size_t len, const char *tag, size_t taglen)
+{
+	if((command->flags & CMD_OFFLOAD) && workers.count && !offload_command(cmdsocket, command, params, len, tag, taglen)) {
+		DEBUG_OUT("Offloaded command %s for client on fd %d\n", command->name, cmdsocket->fd);
+		return 1;
+	}
+
+	command->func(cmdsocket, out, command, params, len);
+	return 0;
+}
+
+// A line found in a client's input, split the way process_command() runs it:
+// the command name is the first run of characters other than spaces and tabs,
+// and its parameters are everything after the space or tab that ends it.
+// line and len describe the line without its terminator, cmd and cmdlen the
+// position of the command name within it, and consumed is the size of the
+// line including its terminator.
+struct linespan {
+	const char *line;
+	size_t len;
+	size_t cmd;
+	size_t cmdlen;
+	size_t consumed;
+};
+
+// Number of lines process_lines() asks scan_lines() to find at once
+#define SCAN_BATCH	64
+
+// Bit masks of the line terminators (CR and LF) and the blanks (space and tab)
+// in a 64-byte block of input: bit i is set if byte i is one
+struct scanblock {
+	uint64_t eol;
+	uint64_t blank;
+};
+
+// Kinds of characters scan_next() looks for
+#define SCAN_TEXT	0	// Anything but a blank
+#define SCAN_DELIM	1	// A blank or a line terminator
+#define SCAN_EOL	2	// A line terminator
+#define SCAN_NOT_EOL	3	// Anything but a line terminator
+
+// The vectorized part of scan_lines(): one pass over 64 bytes, looking for all
+// four characters at once
+static void scan_block_scalar(const char *p, struct scanblock *block)
+{
+	uint64_t eol = 0, blank = 0;
+	int i;
+
+	for(i = 0; i < 64; i++) {
+		eol |= (uint64_t)(p[i] == '\r' || p[i] == '\n') << i;
+		blank |= (uint64_t)(p[i] == ' ' || p[i] == '\t') << i;
+	}
+
+	block->eol = eol;
+	block->blank = blank;
+}
+
+// Returns the offset of the first line terminator in the len bytes at p, or
+// len if there is none.  Skips over long parameters faster than going through
+// them a block at a time.
+static size_t scan_eol_scalar(const char *p, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < len && p[i] != '\r' && p[i] != '\n'; i++);
+
+	return i;
+}
+
+#ifdef __SSE2__
+static void scan_block_sse2(const char *p, struct scanblock *block)
+{
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+	const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	uint64_t eol = 0, blank = 0;
+	__m128i v;
+	int i;
+
+	for(i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		eol |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf))) << i;
+		blank |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab))) << i;
+	}
+
+	block->eol = eol;
+	block->blank = blank;
+}
+
+static size_t scan_eol_sse2(const char *p, size_t len)
+{
+	const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+	__m128i v;
+	size_t i;
+	int mask;
+
+	for(i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+		if(mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + scan_eol_scalar(p + i, len - i);
+}
+
+// Compiled for AVX2 even if the rest of the server isn't, and only used if
+// the CPU has it (see init_scanner())
+__attribute__((target("avx2")))
+static void scan_block_avx2(const char *p, struct scanblock *block)
+{
+	const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+	const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+	uint64_t eol = 0, blank = 0;
+	__m256i v;
+	int i;
+
+	for(i = 0; i < 64; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		eol |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf))) << i;
+		blank |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab))) << i;
+	}
+
+	block->eol = eol;
+	block->blank = blank;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_eol_avx2(const char *p, size_t len)
+{
+	const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+	__m256i v;
+	size_t i;
+	int mask;
+
+	for(i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+		if(mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+
+	return i + scan_eol_scalar(p + i, len - i);
+}
+#endif /* __SSE2__ */
+
+// The scanner functions in use, and their name for --benchmark=scan
+static void (*scan_block)(const char *p, struct scanblock *block) = scan_block_scalar;
+static size_t (*scan_eol)(const char *p, size_t len) = scan_eol_scalar;
+static const char *scan_name = "scalar";
+
+// Picks the fastest block scanner the CPU supports
+static void init_scanner(void)
+{
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		scan_block = scan_block_avx2;
+		scan_eol = scan_eol_avx2;
+		scan_name = "avx2";
+	} else {
+		scan_block = scan_block_sse2;
+		scan_eol = scan_eol_sse2;
+		scan_name = "sse2";
+	}
+#endif
+}
+
+// The position of scan_lines() in its buffer, and the masks of the 64-byte
+// block it is in.  Blocks are aligned to the start of the buffer.
+struct scanner {
+	const char *buf;
+	size_t len;
+	size_t base;
+	struct scanblock block;
+};
+
+// Scans the block starting at base.  The last block of the buffer is padded
+// with zeros, which are neither blanks nor terminators.
+static void scanner_load(struct scanner *scanner, size_t base)
+{
+	char tail[64];
+
+	scanner->base = base;
+	if(base + 64 <= scanner->len) {
+		scan_block(scanner->buf + base, &scanner->block);
+	} else {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, scanner->buf + base, scanner->len - base);
+		scan_block(tail, &scanner->block);
+	}
+}
+
+// Returns the offset of the first character of the given kind (SCAN_*) at or
+// after pos, or the length of the buffer if there is none.  Searches only ever
+// move forward, so pos must not be before the current block.
+static size_t scan_next(struct scanner *scanner, size_t pos, int kind)
+{
+	uint64_t mask;
+
+	while(pos < scanner->len) {
+		if(pos >= scanner->base + 64) {
+			scanner_load(scanner, pos & ~(size_t)63);
+		}
+
+		switch(kind) {
+			case SCAN_TEXT:
+				mask = ~scanner->block.blank;
+				break;
+			case SCAN_DELIM:
+				mask = scanner->block.blank | scanner->block.eol;
+				break;
+			case SCAN_EOL:
+				mask = scanner->block.eol;
+				break;
+			default:
+				mask = ~scanner->block.eol;
+				break;
+		}
+
+		mask &= ~(uint64_t)0 << (pos - scanner->base);
+		if(mask != 0) {
+			pos = scanner->base + __builtin_ctzll(mask);
+			return pos < scanner->len ? pos : scanner->len;
+		}
+		pos = scanner->base + 64;
+
+		// Parameters are skipped without looking for blanks
+		if(kind == SCAN_EOL && pos < scanner->len) {
+			pos += scan_eol(scanner->buf + pos, scanner->len - pos);
+		}
+	}
+
+	return scanner->len;
+}
+
+// Finds up to max complete lines at the start of the len bytes at buf and
+// splits each one into spans, in a single pass over 64-byte blocks instead of
+// a search for the terminator followed by byte-at-a-time tokenizing.  Stops
+// early at a line longer than config.max_line (which read_line() will then
+// reject), and, unless final is set, at a terminator that reaches the end of
+// buf, since it may continue in the data that follows.  Returns the number of
+// lines found.
+static size_t scan_lines(const char *buf, size_t len, int final, struct linespan *spans, size_t max)
+{
+	struct scanner scanner = { .buf = buf, .len = len };
+	size_t pos = 0, cmd, delim, eol, end;
+	size_t count = 0;
+
+	if(len == 0) {
+		return 0;
+	}
+	scanner_load(&scanner, 0);
+
+	while(count < max && pos < len) {
+		cmd = scan_next(&scanner, pos, SCAN_TEXT);
+		delim = scan_next(&scanner, cmd, SCAN_DELIM);
+		if(delim < len && (buf[delim] == '\r' || buf[delim] == '\n')) {
+			eol = delim;
+		} else {
+			eol = scan_next(&scanner, delim, SCAN_EOL);
+		}
+		if(eol == len || eol - pos > config.max_line) {
+			break;
+		}
+		end = scan_next(&scanner, eol, SCAN_NOT_EOL);
+		if(end == len && !final) {
+			break;
+		}
+
+		spans[count].line = buf + pos;
+		spans[count].len = eol - pos;
+		spans[count].cmd = cmd - pos;
+		spans[count].cmdlen = cmd < eol ? delim - cmd : 0;
+		spans[count].consumed = end - pos;
+		count++;
+		pos = end;
+	}
+
+	return count;
+}
+
+// Splits the line of len bytes at cmdline the same way as scan_lines(), one
+// byte at a time.  Used for lines that read_line() had to find.
+static void split_line(const char *cmdline, size_t len, size_t consumed, struct linespan *span)
+{
+	size_t cmd, cmdlen;
+
+	for(cmd = 0; cmd < len && (cmdline[cmd] == ' ' || cmdline[cmd] == '\t'); cmd++);
+	for(cmdlen = 0; cmd + cmdlen < len && cmdline[cmd + cmdlen] != ' ' && cmdline[cmd + cmdlen] != '\t'; cmdlen++);
+
+	span->line = cmdline;
+	span->len = len;
+	span->cmd = cmd;
+	span->cmdlen = cmdlen;
+	span->consumed = consumed;
+}
+
+// Returns the length of the line's tag (see TAG_MAX), or 0 if it isn't tagged
+static size_t line_tag(const struct linespan *span)
+{
+	if(span->cmdlen < 2 || span->cmdlen > TAG_MAX + 1 || span->line[span->cmd] != '@') {
+		return 0;
+	}
+	return span->cmdlen - 1;
+}
+
+// Runs the command on a line split by scan_lines() or split_line().  The line
+// does not need to be NUL-terminated, and is not modified.  Returns the
+// command, or NULL if the line was empty or the command unknown.
+static struct command *process_command(const struct linespan *span, struct cmdsocket *cmdsocket)
+{
+	struct command *command;
+	struct evbuffer *output;
+	struct linespan untagged;
+	const char *cmd, *params, *tag = NULL;
+	size_t cmdlen, paramlen, taglen;
+
+	// A tagged line's command follows the tag, and its output is collected
+	// in the loop's reply buffer so that its length is known
+	taglen = line_tag(span);
+	if(taglen) {
+		tag = span->line + span->cmd + 1;
+		split_line(tag + taglen, span->len - span->cmd - span->cmdlen, span->consumed, &untagged);
+		span = &untagged;
+		output = cmdsocket->loop->reply;
+	} else {
+		output = cmdsocket_output(cmdsocket);
+		if(output == NULL) {
+			// The client is being closed
+			return NULL;
+		}
+	}
+
+	if(span->cmdlen == 0) {
+		// The line was empty -- no command was given
+		if(taglen) {
+			tag_reply(cmdsocket, tag, taglen, output);
+		} else {
+			send_prompt(cmdsocket);
+		}
+		return NULL;
+	}
+
+	cmd = span->line + span->cmd;
+	cmdlen = span->cmdlen;
+	if(span->cmd + cmdlen == span->len) {
+		// There are no parameters
+		params = "";
+		paramlen = 0;
+	} else {
+		// There may be parameters
+		params = cmd + cmdlen + 1; // Skip first space after command name
+		paramlen = span->len - span->cmd - cmdlen - 1;
+	}
+
+	DEBUG_OUT("Command received: %.*s\n", LEN_STR(cmdlen, cmd));
+	cmdsocket->commands++;
+	STAT_ADD(cmdsocket->loop, commands, 1);
+
+	// Execute the command, if it is valid
+	command = find_command(&cmdsocket->loop->cmds->table, cmd, cmdlen);
+	if(command != NULL) {
+		DEBUG_OUT("Running command %s\n", command->name);
+		if(run_command(cmdsocket, output, command, params, paramlen, tag, taglen)) {
+			// The prompt (or tag) follows the output once the command
+			// finishes
+			return command;
+		}
+	} else {
+		DEBUG_OUT("Unknown command: %.*s\n", LEN_STR(cmdlen, cmd));
+		STAT_ADD(cmdsocket->loop, unknown, 1);
+		ADD_STATIC(output, "Unknown command: ");
+		evbuffer_add(output, cmd, cmdlen);
+		ADD_STATIC(output, "\n");
+	}
+
+	if(taglen) {
+		tag_reply(cmdsocket, tag, taglen, output);
+	} else {
+		send_prompt(cmdsocket);
+	}
+	return command;
+}
+
+// Looks for a complete line in the client's input buffer, starting the search
+// where the previous call left off.  Returns 1 if a line was found, 0 if no
+// complete line has arrived yet, or -1 if the line is longer than the maximum
+// line length.
+//
+// When a line is found, *line and *len describe the line without its
+// terminator, and *consumed is set to the number of bytes to drain from the
+// input once the line has been processed.  *line points directly into the
+// input buffer when the line is stored contiguously, or into the loop's line
+// buffer otherwise, so no memory is allocated for the line.  It is not
+// NUL-terminated, and is only valid until the input buffer is drained or
+// read_line() is called again on the same loop.
+static int read_line(struct cmdsocket *cmdsocket, const char **line, size_t *len, size_t *consumed)
+{
+	struct evbuffer *input = bufferevent_get_input(cmdsocket->buf_event);
+	size_t buflen = evbuffer_get_length(input);
+	struct evbuffer_ptr eol;
+	struct evbuffer_iovec vec;
+	size_t eol_len;
+
+	if(cmdsocket->scan_offset >= buflen) {
+		// No new data since the last search
+		return 0;
+	}
+
+	if(evbuffer_ptr_set(input, &eol, cmdsocket->scan_offset, EVBUFFER_PTR_SET)) {
+		ERROR_OUT("BUG: Scan offset %zu is past the end of the input on fd %d\n",
+				cmdsocket->scan_offset, cmdsocket->fd);
+		cmdsocket->scan_offset = 0;
+		return 0;
+	}
+	eol = evbuffer_search_eol(input, &eol, &eol_len, EVBUFFER_EOL_ANY);
+	if(eol.pos < 0) {
+		// Only the new data needs to be searched next time
+		cmdsocket->scan_offset = buflen;
+		if(buflen > config.max_line) {
+			ERROR_OUT("Partial line from client on fd %d exceeds %zu bytes.\n",
+					cmdsocket->fd, config.max_line);
+			return -1;
+		}
+		return 0;
+	}
+	if((size_t)eol.pos > config.max_line) {
+		ERROR_OUT("Line from client on fd %d exceeds %zu bytes.\n", cmdsocket->fd, config.max_line);
+		return -1;
+	}
+
+	*len = eol.pos;
+	*consumed = eol.pos + eol_len;
+	cmdsocket->scan_offset = 0;
+
+	if(*len == 0) {
+		*line = "";
+	} else if(evbuffer_peek(input, *len, NULL, &vec, 1) >= 1 && vec.iov_len >= *len) {
+		*line = vec.iov_base;
+	} else {
+		// The line spans more than one chunk of the input buffer
+		evbuffer_copyout(input, cmdsocket->loop->linebuf, *len);
+		*line = cmdsocket->loop->linebuf;
+	}
+
+	return 1;
+}
+
+// Finds up to max complete lines in the first chunk of the client's input with
+// scan_lines().  The spans point into the input buffer, and stay valid while
+// the lines before them are drained.
+static size_t scan_input(struct cmdsocket *cmdsocket, struct linespan *spans, size_t max)
+{
+	struct evbuffer *input = bufferevent_get_input(cmdsocket->buf_event);
+	struct evbuffer_iovec vec;
+	int chunks;
+
+	chunks = evbuffer_peek(input, -1, NULL, &vec, 1);
+	if(chunks < 1) {
+		return 0;
+	}
+
+	return scan_lines(vec.iov_base, vec.iov_len, chunks == 1, spans, max);
+}
+
+// Returns the number of bytes of output waiting to be sent to the client
+static size_t pending_output(struct cmdsocket *cmdsocket)
+{
+	return (cmdsocket->buffer != NULL ? evbuffer_get_length(cmdsocket->buffer) : 0) +
+		evbuffer_get_length(bufferevent_get_output(cmdsocket->buf_event));
+}
+
+// Pauses the client if it has more than config.write_high bytes of output
+// waiting: nothing more is read from it, and none of the commands it already
+// sent are run, until cmd_write() finds that its output has dropped to
+// config.write_low bytes.
+static void check_output(struct cmdsocket *cmdsocket)
+{
+	if(cmdsocket->paused || pending_output(cmdsocket) <= config.write_high) {
+		return;
+	}
+
+	DEBUG_OUT("Pausing client on fd %d until it reads its output.\n", cmdsocket->fd);
+	if(cmdsocket->uring == NULL) {
+		bufferevent_disable(cmdsocket->buf_event, EV_READ);
+	}
+	cmdsocket->paused = 1;
+	STAT_ADD(cmdsocket->loop, pauses, 1);
+	STAT_ADD(cmdsocket->loop, paused, 1);
+}
+
+// Returns nonzero if the client's commands have to wait for something: it has
+// been shut down, is paused until it reads its output, is waiting for an
+// offloaded command (or for its tagged ones, or for room for another), or is
+// throttled.
+static int cmdsocket_held(struct cmdsocket *cmdsocket)
+{
+	return cmdsocket->shutdown || cmdsocket->paused || cmdsocket->job != NULL || cmdsocket->throttled ||
+		cmdsocket->waiting || cmdsocket->inflight == TAGGED_JOBS;
+}
+
+// Takes a token from the client's command bucket if --cmd-rate was given.
+// The bucket is kept as the time at which it will be full again, which is
+// pushed back by 1 / --cmd-rate seconds for each command, and may be at most
+// a second ahead.  Returns 0 if the command may run now, or 1 if the client
+// is out of tokens, in which case it has been put in its loop's throttle
+// queue until a token is available.
+static int throttle_cmdsocket(struct cmdsocket *cmdsocket, uint64_t now)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct timeval delay;
+	uint64_t interval, wait;
+
+	if(config.cmd_rate == 0) {
+		return 0;
+	}
+
+	interval = 1000000000 / config.cmd_rate;
+	if(cmdsocket->cmd_full < now) {
+		cmdsocket->cmd_full = now;
+	}
+	if(cmdsocket->cmd_full + interval - now <= interval * config.cmd_rate) {
+		cmdsocket->cmd_full += interval;
+		return 0;
+	}
+
+	DEBUG_OUT("Throttling client on fd %d.\n", cmdsocket->fd);
+	TAILQ_INSERT_TAIL(&loop->throttle_queue, cmdsocket, ready_link);
+	cmdsocket->throttled = 1;
+	STAT_ADD(loop, throttles, 1);
+
+	// Clients throttled while the timer is pending have later deadlines,
+	// and are throttled again if they come up early
+	if(!evtimer_pending(&loop->throttle_event, NULL)) {
+		wait = cmdsocket->cmd_full + interval - now - interval * config.cmd_rate;
+		delay.tv_sec = wait / 1000000000;
+		delay.tv_usec = wait % 1000000000 / 1000 + 1;
+		if(evtimer_add(&loop->throttle_event, &delay)) {
+			ERROR_OUT("Error scheduling the throttle queue on event loop %d.\n", loop->id);
+		}
+	}
+
+	return 1;
+}
+
+// Returns the index of the given command in its set, or TRACE_UNKNOWN for NULL
+// (or for a module command past the first 255)
+static uint8_t command_index(const struct cmdset *set, struct command *command)
+{
+	return command != NULL && command - set->commands < TRACE_UNKNOWN ? command - set->commands : TRACE_UNKNOWN;
+}
+
+// Saturates a traced duration at what fits in a trace record
+static uint32_t trace_ns(uint64_t ns)
+{
+	return ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+// Picks one in config.trace commands to trace, as long as the loop has room
+// for another unfinished trace.  Returns 1 if the command about to run is to
+// be traced.
+static int trace_sample(struct cmdloop *loop)
+{
+	if(loop->trace_countdown > 1) {
+		loop->trace_countdown--;
+		return 0;
+	}
+	if(loop->npending_traces == TRACE_PENDING) {
+		return 0;
+	}
+
+	loop->trace_countdown = config.trace;
+	return 1;
+}
+
+// Starts the trace of the client's command, which starts running at start
+// after split nanoseconds spent finding it.
+static void trace_begin(struct cmdsocket *cmdsocket, uint64_t start, uint64_t split)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct trace_pending *pending = &loop->pending_traces[loop->npending_traces++];
+	struct trace_record *record = &pending->record;
+
+	pending->cmdsocket = cmdsocket;
+	pending->job = NULL;
+	pending->done = 0;
+
+	memset(record, 0, sizeof(*record));
+	record->time_ns = start;
+	if(cmdsocket->stamped) {
+		record->input_ns = trace_ns((uint64_t)((uint32_t)(start / 1000) - cmdsocket->read_us) * 1000);
+	}
+	record->split_ns = trace_ns(split);
+	record->fd = cmdsocket->fd;
+	record->loop = loop->id;
+	record->command = TRACE_UNKNOWN;
+	if(cmdsocket->protocol == PROTO_BINARY) {
+		record->flags |= TRACE_BINARY;
+	}
+}
+
+// Notes that the client's traced command, if one is running on the loop (or
+// as the given job), finished at end.
+static void trace_ran(struct cmdsocket *cmdsocket, struct cmdjob *job, struct command *command, uint64_t end)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct trace_pending *pending;
+	size_t i;
+
+	for(i = 0; i < loop->npending_traces; i++) {
+		pending = &loop->pending_traces[i];
+		if(pending->cmdsocket != cmdsocket || pending->job != job || pending->done) {
+			continue;
+		}
+
+		pending->record.command = command_index(job != NULL ? job->cmds : loop->cmds, command);
+		pending->record.run_ns = trace_ns(end - pending->record.time_ns);
+		pending->done = end;
+		return;
+	}
+}
+
+// Notes that the client's command running on the loop, if it is traced, has
+// been offloaded as the given job (whose completion calls trace_ran()).
+static void trace_offloaded(struct cmdsocket *cmdsocket, struct cmdjob *job)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct trace_pending *pending;
+	size_t i;
+
+	// A client runs one command at a time on the loop, so only one of its
+	// traces can be unfinished without a job
+	for(i = 0; i < loop->npending_traces; i++) {
+		pending = &loop->pending_traces[i];
+		if(pending->cmdsocket == cmdsocket && pending->job == NULL && !pending->done) {
+			pending->job = job;
+			pending->record.flags |= TRACE_OFFLOADED;
+			return;
+		}
+	}
+}
+
+// Finishes the traces of the client's commands whose output has now been
+// handed to the bufferevent, and adds them to the loop's ring.  Discards the
+// client's unfinished traces instead if discard is set.
+static void trace_flushed(struct cmdsocket *cmdsocket, int discard)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct trace_pending *pending;
+	struct trace_slot *slot;
+	uint64_t now = nsec_now();
+	uint64_t pos;
+	size_t i;
+
+	for(i = loop->npending_traces; i > 0; i--) {
+		pending = &loop->pending_traces[i - 1];
+		if(pending->cmdsocket != cmdsocket || (!pending->done && !discard)) {
+			continue;
+		}
+
+		if(!discard) {
+			// Readers on other threads discard the record if seq
+			// changes while they copy it
+			pending->record.output_ns = trace_ns(now - pending->done);
+			pos = loop->trace_head;
+			slot = &loop->traces[pos & (TRACE_SLOTS - 1)];
+			__atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			slot->record = pending->record;
+			__atomic_store_n(&slot->seq, 2 * (pos + 1), __ATOMIC_RELEASE);
+			__atomic_store_n(&loop->trace_head, pos + 1, __ATOMIC_RELEASE);
+		}
+
+		*pending = loop->pending_traces[--loop->npending_traces];
+	}
+}
+
+// Updates the statistics for a line or frame of consumed bytes whose command
+// took elapsed nanoseconds to run.
+static void count_request(struct cmdsocket *cmdsocket, size_t consumed, uint64_t elapsed)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	int bucket;
+
+	cmdsocket->busy_ns += elapsed;
+	STAT_ADD(loop, lines, 1);
+	STAT_ADD(loop, bytes_in, consumed);
+	bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+	if(bucket >= STATS_LAT_BUCKETS) {
+		bucket = STATS_LAT_BUCKETS - 1;
+	}
+	STAT_ADD(loop, cmd_ns[bucket], 1);
+}
+
+// Checks whether a complete binary frame is waiting in the client's input
+// buffer.  Returns 1 if a frame was found, 0 if it hasn't all arrived yet, or
+// -1 if the frame is malformed or longer than the maximum line length.
+//
+// When a frame is found, *id is its command index, *payload and *len describe
+// its parameters, and *consumed is the size of the whole frame.  Like
+// read_line(), *payload points into the input buffer or the loop's line
+// buffer, and is only valid until the input is drained.
+static int read_frame(struct cmdsocket *cmdsocket, unsigned int *id, const char **payload, size_t *len, size_t *consumed)
+{
+	struct evbuffer *input = bufferevent_get_input(cmdsocket->buf_event);
+	unsigned char header[BIN_HEADER];
+	struct evbuffer_ptr start;
+	struct evbuffer_iovec vec;
+	uint32_t framelen;
+
+	if(evbuffer_copyout(input, header, BIN_HEADER) < BIN_HEADER) {
+		return 0;
+	}
+
+	framelen = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+	if(framelen < BIN_HEADER - 4 || framelen - (BIN_HEADER - 4) > config.max_line) {
+		ERROR_OUT("Invalid frame length %u from client on fd %d.\n", framelen, cmdsocket->fd);
+		return -1;
+	}
+	if(evbuffer_get_length(input) < (size_t)framelen + 4) {
+		return 0;
+	}
+
+	*id = header[4] << 8 | header[5];
+	*len = framelen - (BIN_HEADER - 4);
+	if((*id & BIN_TAGGED) && *len < BIN_TAG) {
+		ERROR_OUT("Tagged frame without a tag from client on fd %d.\n", cmdsocket->fd);
+		return -1;
+	}
+	*consumed = framelen + 4;
+
+	evbuffer_ptr_set(input, &start, BIN_HEADER, EVBUFFER_PTR_SET);
+	if(*len == 0) {
+		*payload = "";
+	} else if(evbuffer_peek(input, *len, &start, &vec, 1) >= 1 && vec.iov_len >= *len) {
+		*payload = vec.iov_base;
+	} else {
+		evbuffer_copyout_from(input, &start, cmdsocket->loop->linebuf, *len);
+		*payload = cmdsocket->loop->linebuf;
+	}
+
+	return 1;
+}
+
+// Moves the contents of reply to the end of output.  Short replies are copied
+// so the output buffer doesn't fill up with tiny chunks; longer ones are moved.
+static void move_reply(struct evbuffer *output, struct evbuffer *reply)
+{
+	struct evbuffer_iovec vec;
+	size_t len = evbuffer_get_length(reply);
+
+	if(len < STATIC_REF_MIN && evbuffer_peek(reply, len, NULL, &vec, 1) == 1) {
+		evbuffer_add(output, vec.iov_base, len);
+		evbuffer_drain(reply, len);
+	} else {
+		evbuffer_add_buffer(output, reply);
+	}
+}
+
+// Adds a binary protocol reply with the given status, the request's tag (if
+// taglen isn't 0), and the contents of reply (which is left empty) to the
+// client's output buffer.
+static void frame_reply(struct cmdsocket *cmdsocket, int status, const char *tag, size_t taglen, struct evbuffer *reply)
+{
+	struct evbuffer *output = cmdsocket_output(cmdsocket);
+	unsigned char header[BIN_HEADER + BIN_TAG];
+	uint32_t replylen;
+
+	if(output == NULL) {
+		evbuffer_drain(reply, evbuffer_get_length(reply));
+		return;
+	}
+
+	if(taglen) {
+		status |= BIN_TAGGED;
+		memcpy(header + BIN_HEADER, tag, BIN_TAG);
+	}
+	replylen = evbuffer_get_length(reply) + taglen + BIN_HEADER - 4;
+	header[0] = replylen >> 24;
+	header[1] = replylen >> 16;
+	header[2] = replylen >> 8;
+	header[3] = replylen;
+	header[4] = status >> 8;
+	header[5] = status;
+	if(evbuffer_add(output, header, BIN_HEADER + taglen)) {
+		ERROR_OUT("Error framing reply for client on fd %d.\n", cmdsocket->fd);
+	}
+	move_reply(output, reply);
+}
+
+// Adds the reply to a tagged text request, "@TAG LENGTH\n" followed by the
+// contents of reply (which is left empty), to the client's output buffer.
+static void tag_reply(struct cmdsocket *cmdsocket, const char *tag, size_t taglen, struct evbuffer *reply)
+{
+	struct evbuffer *output = cmdsocket_output(cmdsocket);
+
+	if(output == NULL) {
+		evbuffer_drain(reply, evbuffer_get_length(reply));
+		return;
+	}
+
+	if(evbuffer_add_printf(output, "@%.*s %zu\n", LEN_STR(taglen, tag), evbuffer_get_length(reply)) < 0) {
+		ERROR_OUT("Error tagging reply for client on fd %d.\n", cmdsocket->fd);
+	}
+	move_reply(output, reply);
+}
+
+// The binary protocol counterpart of process_lines(), with the same return
+// values.  Each command writes to the loop's reply buffer instead of the
+// client's output buffer, so that its length is known when frame_reply() adds
+// it to the output buffer.
+static int process_frames(struct cmdsocket *cmdsocket)
+{
+	struct evbuffer *input = bufferevent_get_input(cmdsocket->buf_event);
+	struct evbuffer *reply = cmdsocket->loop->reply;
+	struct command *command;
+	const char *payload, *tag;
+	size_t len, consumed, taglen;
+	uint64_t start, end, last = 0;
+	unsigned int id;
+	int traced;
+	int ret;
+	int i;
+
+	if(config.trace) {
+		last = nsec_now();
+	}
+
+	for(i = 0; i < config.cmd_budget && !cmdsocket_held(cmdsocket); i++) {
+		ret = read_frame(cmdsocket, &id, &payload, &len, &consumed);
+		if(ret == 0) {
+			break;
+		}
+		if(ret < 0) {
+			ERROR_OUT("Disconnecting client on fd %d.\n", cmdsocket->fd);
+			STAT_ADD(cmdsocket->loop, overlong, 1);
+			free_cmdsocket(cmdsocket);
+			return -1;
+		}
+
+		// An untagged request waits for the client's tagged commands, so
+		// that its reply comes after theirs
+		if(cmdsocket->inflight && !(id & BIN_TAGGED)) {
+			cmdsocket->waiting = 1;
+			break;
+		}
+
+		start = nsec_now();
+		if(throttle_cmdsocket(cmdsocket, start)) {
+			break;
+		}
+
+		traced = config.trace && trace_sample(cmdsocket->loop);
+		if(traced) {
+			trace_begin(cmdsocket, start, start - last);
+		}
+
+		DEBUG_OUT("Read a frame for command %u with %zu bytes from client on fd %d\n", id, len, cmdsocket->fd);
+		tag = NULL;
+		taglen = 0;
+		if(id & BIN_TAGGED) {
+			id &= ~BIN_TAGGED;
+			tag = payload;
+			taglen = BIN_TAG;
+			payload += BIN_TAG;
+			len -= BIN_TAG;
+		}
+		cmdsocket->commands++;
+		STAT_ADD(cmdsocket->loop, commands, 1);
+		command = NULL;
+		if(id < cmdsocket->loop->cmds->count) {
+			command = &cmdsocket->loop->cmds->commands[id];
+			if(!run_command(cmdsocket, reply, command, payload, len, tag, taglen)) {
+				frame_reply(cmdsocket, BIN_OK, tag, taglen, reply);
+			}
+		} else {
+			DEBUG_OUT("Unknown command index: %u\n", id);
+			STAT_ADD(cmdsocket->loop, unknown, 1);
+			frame_reply(cmdsocket, BIN_UNKNOWN, tag, taglen, reply);
+		}
+
+		evbuffer_drain(input, consumed);
+		end = nsec_now();
+		count_request(cmdsocket, consumed, end - start);
+		if(traced) {
+			trace_ran(cmdsocket, NULL, command, end);
+		}
+		last = end;
+		check_output(cmdsocket);
+	}
+	if(config.trace && evbuffer_get_length(input) == 0) {
+		cmdsocket->stamped = 0;
+	}
+
+	flush_cmdsocket(cmdsocket);
+
+	// A malformed frame is reported (and the client disconnected) on the
+	// next turn
+	return !cmdsocket_held(cmdsocket) && read_frame(cmdsocket, &id, &payload, &len, &consumed) != 0;
+}
+
+// Runs up to config.cmd_budget commands from the client's input buffer and
+// sends the results.  Returns 1 if complete lines may still be waiting, 0 if
+// not, or -1 if the connection was closed (and its cmdsocket freed).
+static int process_lines(struct cmdsocket *cmdsocket)
+{
+	struct evbuffer *input = bufferevent_get_input(cmdsocket->buf_event);
+	struct linespan spans[SCAN_BATCH];
+	struct linespan line, *span;
+	size_t nspans = 0, next = 0, drain = 0;
+	struct command *command;
+	const char *cmdline;
+	size_t len, consumed;
+	uint64_t start, end, last = 0;
+	unsigned char first;
+	int traced;
+	int ret;
+	int i;
+
+	// The first byte from the client picks the protocol
+	if(cmdsocket->protocol == PROTO_NEW) {
+		if(evbuffer_copyout(input, &first, 1) < 1) {
+			return 0;
+		}
+		if(first == BIN_MAGIC) {
+			DEBUG_OUT("Client on fd %d is using the binary protocol.\n", cmdsocket->fd);
+			evbuffer_drain(input, 1);
+			cmdsocket->protocol = PROTO_BINARY;
+		} else {
+			cmdsocket->protocol = PROTO_LINE;
+		}
+	}
+	if(cmdsocket->protocol == PROTO_BINARY) {
+		return process_frames(cmdsocket);
+	}
+
+	// With --trace, the time spent finding each line is the time since the
+	// previous command finished
+	if(config.trace) {
+		last = nsec_now();
+	}
+
+	for(i = 0; i < config.cmd_budget && !cmdsocket_held(cmdsocket); i++) {
+		// Lines are found a batch at a time by scan_lines(), and one at a
+		// time by read_line() when a partial line has already been
+		// searched or the next line doesn't fit in the first chunk.  A
+		// batch's lines are drained together once it has been used.
+		if(next == nspans) {
+			evbuffer_drain(input, drain);
+			drain = 0;
+			nspans = next = 0;
+			if(cmdsocket->scan_offset == 0) {
+				nspans = scan_input(cmdsocket, spans, MIN(SCAN_BATCH, config.cmd_budget - i));
+			}
+		}
+		if(next < nspans) {
+			span = &spans[next++];
+		} else {
+			ret = read_line(cmdsocket, &cmdline, &len, &consumed);
+			if(ret == 0) {
+				// No data, or data has arrived, but no end-of-line was found
+				break;
+			}
+			if(ret < 0) {
+				ERROR_OUT("Disconnecting client on fd %d.\n", cmdsocket->fd);
+				STAT_ADD(cmdsocket->loop, overlong, 1);
+				free_cmdsocket(cmdsocket);
+				return -1;
+			}
+			split_line(cmdline, len, consumed, &line);
+			span = &line;
+		}
+
+		// An untagged line waits for the client's tagged commands, so
+		// that its reply comes after theirs.  It is found again, like a
+		// throttled line, when the client is released.
+		if(cmdsocket->inflight && !line_tag(span)) {
+			cmdsocket->waiting = 1;
+			break;
+		}
+
+		// A throttled line is found again when the client is released
+		start = nsec_now();
+		if(throttle_cmdsocket(cmdsocket, start)) {
+			break;
+		}
+
+		traced = config.trace && trace_sample(cmdsocket->loop);
+		if(traced) {
+			trace_begin(cmdsocket, start, start - last);
+		}
+
+		DEBUG_OUT("Read a line of length %zd from client on fd %d: %.*s\n", span->len, cmdsocket->fd, LEN_STR(span->len, span->line));
+		command = process_command(span, cmdsocket);
+		if(span == &line) {
+			evbuffer_drain(input, span->consumed);
+		} else {
+			drain += span->consumed;
+		}
+		end = nsec_now();
+		count_request(cmdsocket, span->consumed, end - start);
+		if(traced) {
+			trace_ran(cmdsocket, NULL, command, end);
+		}
+		last = end;
+		check_output(cmdsocket);
+	}
+	evbuffer_drain(input, drain);
+	if(config.trace && evbuffer_get_length(input) == 0) {
+		cmdsocket->stamped = 0;
+	}
+
+	// Send the results to the client
+	flush_cmdsocket(cmdsocket);
+
+	// Any input that hasn't been searched yet may hold more lines, but a
+	// held client's lines wait (see cmdsocket_held())
+	return !cmdsocket_held(cmdsocket) && evbuffer_get_length(input) > cmdsocket->scan_offset;
+}
+
+// Puts the given cmdsocket at the back of its loop's ready queue, and makes
+// sure the queue is served on the next event loop iteration.
+static void queue_cmdsocket(struct cmdsocket *cmdsocket)
+{
+	static const struct timeval next_iteration = { 0, 0 };
+	struct cmdloop *loop = cmdsocket->loop;
+
+	if(cmdsocket->ready) {
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&loop->ready_queue, cmdsocket, ready_link);
+	cmdsocket->ready = 1;
+
+	// Hold back partial segments until the batch has been processed
+	cork_cmdsocket(cmdsocket, 1);
+
+	// A zero timeout (rather than event_active()) lets the loop check for
+	// I/O before the queue is served
+	if(!evtimer_pending(&loop->ready_event, NULL) && evtimer_add(&loop->ready_event, &next_iteration)) {
+		ERROR_OUT("Error scheduling the ready queue on event loop %d.\n", loop->id);
+	}
+}
+
+// Gives each connection in the loop's ready queue one turn.  Connections that
+// still have lines waiting go to the back of the queue for the next turn.
+static void serve_ready(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	struct cmdsocket *cmdsocket, *last;
+
+	// Connections queued during this pass wait for the next one
+	last = TAILQ_LAST(&loop->ready_queue, cmdsocket_queue);
+	while((cmdsocket = TAILQ_FIRST(&loop->ready_queue)) != NULL) {
+		TAILQ_REMOVE(&loop->ready_queue, cmdsocket, ready_link);
+		cmdsocket->ready = 0;
+
+		switch(process_lines(cmdsocket)) {
+			case 1:
+				queue_cmdsocket(cmdsocket);
+				break;
+
+			case 0:
+				// The batch is done, so let the last replies go out
+				cork_cmdsocket(cmdsocket, 0);
+				drain_cmdsocket(cmdsocket);
+				break;
+		}
+
+		if(cmdsocket == last) {
+			break;
+		}
+	}
+}
+
+// Gives the throttled connections on the loop another turn now that their
+// command buckets have a token.
+static void release_throttled(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	struct cmdsocket_queue due;
+	struct cmdsocket *cmdsocket;
+
+	// Connections that are still out of tokens go back in the loop's queue
+	TAILQ_INIT(&due);
+	TAILQ_CONCAT(&due, &loop->throttle_queue, ready_link);
+	while((cmdsocket = TAILQ_FIRST(&due)) != NULL) {
+		TAILQ_REMOVE(&due, cmdsocket, ready_link);
+		cmdsocket->throttled = 0;
+
+		switch(process_lines(cmdsocket)) {
+			case 1:
+				queue_cmdsocket(cmdsocket);
+				break;
+
+			case 0:
+				drain_cmdsocket(cmdsocket);
+				break;
+		}
+	}
+}
+
+static void cmd_read(struct bufferevent *buf_event, void *arg)
+{
+	struct cmdsocket *cmdsocket = (struct cmdsocket *)arg;
+
+	// Just note the time; the timeout wheel checks it when the
+	// connection's old deadline comes up
+	cmdsocket->last_active = cmdsocket->loop->now;
+
+	// Traces count the time input waits from the read that brought the
+	// oldest of it
+	if(config.trace && !cmdsocket->stamped) {
+		cmdsocket->read_us = nsec_now() / 1000;
+		cmdsocket->stamped = 1;
+	}
+
+	// A connection that is already waiting its turn doesn't get to skip
+	// ahead just because more data arrived (and a paused one waits until
+	// it has read its output, one with an offloaded command until the
+	// command finishes, and a throttled one until it has a token)
+	if(cmdsocket->ready || cmdsocket->paused || cmdsocket->job != NULL || cmdsocket->throttled) {
+		return;
+	}
+
+	switch(process_lines(cmdsocket)) {
+		case 1:
+			queue_cmdsocket(cmdsocket);
+			break;
+
+		case 0:
+			drain_cmdsocket(cmdsocket);
+			break;
+	}
+}
+
+// Called each time a write leaves config.write_low bytes or less of the
+// client's output unsent.  Resumes a paused client, running the commands
+// that were waiting.
+static void cmd_write(struct bufferevent *buf_event, void *arg)
+{
+	struct cmdsocket *cmdsocket = (struct cmdsocket *)arg;
+
+	if(!cmdsocket->paused) {
+		drain_cmdsocket(cmdsocket);
+		return;
+	}
+	if(pending_output(cmdsocket) > config.write_low) {
+		return;
+	}
+
+	DEBUG_OUT("Resuming client on fd %d.\n", cmdsocket->fd);
+	cmdsocket->paused = 0;
+	STAT_ADD(cmdsocket->loop, paused, -1);
+	if(cmdsocket->uring == NULL && bufferevent_enable(cmdsocket->buf_event, EV_READ)) {
+		ERROR_OUT("Error resuming reads on fd %d.\n", cmdsocket->fd);
+	}
+
+	if(process_lines(cmdsocket) == 1) {
+		queue_cmdsocket(cmdsocket);
+	}
+}
+
+// Adds the output of an offloaded command that has finished to its client's
+// output, then runs the client's commands that were waiting for it.
+static void complete_job(struct cmdjob *job)
+{
+	struct cmdsocket *cmdsocket = job->cmdsocket;
+	struct evbuffer *output;
+
+	if(job->taglen ? cmdsocket_id(cmdsocket) != job->conn_id : cmdsocket->job != job) {
+		// The client disconnected while the command ran
+		DEBUG_OUT("Discarding output of %s for a closed connection.\n", job->command->name);
+		free_job(job);
+		return;
+	}
+	if(job->taglen) {
+		cmdsocket->inflight--;
+		if(cmdsocket->inflight == 0) {
+			cmdsocket->waiting = 0;
+		}
+	} else {
+		cmdsocket->job = NULL;
+	}
+	if(cmdsocket->loop->npending_traces > 0) {
+		trace_ran(cmdsocket, job, job->command, nsec_now());
+	}
+
+	if(cmdsocket->protocol == PROTO_BINARY) {
+		frame_reply(cmdsocket, BIN_OK, job->tag, job->taglen, job->output);
+	} else if(job->taglen) {
+		tag_reply(cmdsocket, job->tag, job->taglen, job->output);
+	} else if((output = cmdsocket_output(cmdsocket)) != NULL) {
+		evbuffer_add_buffer(output, job->output);
+		send_prompt(cmdsocket);
+	}
+	free_job(job);
+	check_output(cmdsocket);
+
+	// A client with tagged commands may already be waiting its turn in the
+	// ready queue
+	if(cmdsocket->ready) {
+		flush_cmdsocket(cmdsocket);
+		return;
+	}
+
+	// This also flushes the output
+	switch(process_lines(cmdsocket)) {
+		case 1:
+			queue_cmdsocket(cmdsocket);
+			break;
+
+		case 0:
+			drain_cmdsocket(cmdsocket);
+			break;
+	}
+}
+
+// Makes the loop wake up and handle the given LOOP_* requests (if any) and
+// its finished jobs.  Safe to call from any thread.
+static void wake_loop(struct cmdloop *loop, int requests)
+{
+	static const uint64_t one = 1;
+
+	if(requests) {
+		__atomic_fetch_or(&loop->requests, requests, __ATOMIC_RELEASE);
+	}
+	if(write(loop->wake_fd, &one, sizeof(one)) < 0) {
+		ERRNO_OUT("Error waking event loop %d", loop->id);
+	}
+}
+
+// Completes the loop's jobs that the workers have finished, in the order they
+// finished.
+static void finish_jobs(struct cmdloop *loop)
+{
+	struct cmdjob *job, *next;
+
+	pthread_mutex_lock(&loop->done_lock);
+	job = loop->done_head;
+	loop->done_head = NULL;
+	loop->done_tail = NULL;
+	pthread_mutex_unlock(&loop->done_lock);
+
+	for(; job != NULL; job = next) {
+		next = job->next;
+		complete_job(job);
+	}
+}
+
+// Drops a reference to a broadcast, freeing it if it was the last.  Called
+// from any loop, and by libevent (as an evbuffer reference cleanup function)
+// when a subscriber's output buffer is done with it.
+static void put_broadcast(const void *data, size_t len, void *arg)
+{
+	struct broadcast *broadcast = arg;
+
+	if(__atomic_sub_fetch(&broadcast->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(broadcast);
+	}
+}
+
+// Builds a broadcast of the given message and queues it to every loop.
+// Returns 0 on success, -1 on error.
+static int send_broadcast(const char *message, size_t len)
+{
+	static const char prefix[] = "Broadcast: ";
+	struct broadcast *broadcast;
+	struct broadcast_link *link;
+	unsigned char *header;
+	uint32_t framelen;
+	size_t textlen;
+	int i;
+
+	textlen = sizeof(prefix) - 1 + len + 1;
+	broadcast = malloc(sizeof(struct broadcast) + config.threads * sizeof(struct broadcast_link) + BIN_HEADER + textlen);
+	if(broadcast == NULL) {
+		ERRNO_OUT("Error allocating a broadcast of %zu bytes", len);
+		return -1;
+	}
+	broadcast->refs = config.threads;
+	broadcast->len = BIN_HEADER + textlen;
+	broadcast->data = (char *)&broadcast->links[config.threads];
+
+	header = (unsigned char *)broadcast->data;
+	framelen = textlen + BIN_HEADER - 4;
+	header[0] = framelen >> 24;
+	header[1] = framelen >> 16;
+	header[2] = framelen >> 8;
+	header[3] = framelen;
+	header[4] = BIN_BROADCAST >> 8;
+	header[5] = BIN_BROADCAST & 0xff;
+	memcpy(broadcast->data + BIN_HEADER, prefix, sizeof(prefix) - 1);
+	memcpy(broadcast->data + BIN_HEADER + sizeof(prefix) - 1, message, len);
+	broadcast->data[broadcast->len - 1] = '\n';
+
+	for(i = 0; i < config.threads; i++) {
+		link = &broadcast->links[i];
+		link->next = NULL;
+		link->broadcast = broadcast;
+
+		pthread_mutex_lock(&loops[i].inbox_lock);
+		if(loops[i].inbox_tail != NULL) {
+			loops[i].inbox_tail->next = link;
+		} else {
+			loops[i].inbox_head = link;
+		}
+		loops[i].inbox_tail = link;
+		pthread_mutex_unlock(&loops[i].inbox_lock);
+
+		wake_loop(&loops[i], 0);
+	}
+
+	return 0;
+}
+
+// Removes the client from its loop's subscribers, if it is subscribed
+static void unsubscribe(struct cmdsocket *cmdsocket)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+
+	if(!cmdsocket->subscribed) {
+		return;
+	}
+
+	if(loop->fanout_next == cmdsocket) {
+		loop->fanout_next = TAILQ_NEXT(cmdsocket, sub_link);
+	}
+	TAILQ_REMOVE(&loop->subscribers, cmdsocket, sub_link);
+	cmdsocket->subscribed = 0;
+	STAT_ADD(loop, subscribers, -1);
+}
+
+// Adds a broadcast to a subscriber's output by reference, unless the
+// subscriber already has more than config.write_high bytes of output waiting
+static void deliver_broadcast(struct cmdsocket *cmdsocket, struct broadcast *broadcast)
+{
+	struct cmdloop *loop = cmdsocket->loop;
+	struct evbuffer *output;
+	const char *data = broadcast->data;
+	size_t len = broadcast->len;
+
+	if(cmdsocket->shutdown || pending_output(cmdsocket) > config.write_high) {
+		STAT_ADD(loop, undelivered, 1);
+		return;
+	}
+
+	output = cmdsocket_output(cmdsocket);
+	if(output == NULL) {
+		STAT_ADD(loop, undelivered, 1);
+		return;
+	}
+
+	if(cmdsocket->protocol != PROTO_BINARY) {
+		data += BIN_HEADER;
+		len -= BIN_HEADER;
+	}
+
+	__atomic_add_fetch(&broadcast->refs, 1, __ATOMIC_RELAXED);
+	if(evbuffer_add_reference(output, data, len, put_broadcast, broadcast)) {
+		ERROR_OUT("Error adding broadcast to output for fd %d.\n", cmdsocket->fd);
+		put_broadcast(data, len, broadcast);
+		return;
+	}
+	STAT_ADD(loop, delivered, 1);
+
+	flush_cmdsocket(cmdsocket);
+	check_output(cmdsocket);
+}
+
+// Delivers the loop's queued broadcasts to up to BROADCAST_BUDGET subscribers,
+// then leaves the rest for the next event loop iteration.  Clients that
+// subscribe while a broadcast is being delivered receive it too.
+static void fanout_broadcasts(evutil_socket_t fd, short evtype, void *arg)
+{
+	static const struct timeval next_iteration = { 0, 0 };
+	struct cmdloop *loop = arg;
+	struct broadcast_link *link;
+	struct cmdsocket *cmdsocket;
+	int budget = BROADCAST_BUDGET;
+
+	while((link = loop->fanout_head) != NULL) {
+		while(budget > 0 && (cmdsocket = loop->fanout_next) != NULL) {
+			loop->fanout_next = TAILQ_NEXT(cmdsocket, sub_link);
+			deliver_broadcast(cmdsocket, link->broadcast);
+			budget--;
+		}
+		if(loop->fanout_next != NULL) {
+			break;
+		}
+
+		// Every subscriber has this one; start on the next
+		loop->fanout_head = link->next;
+		if(loop->fanout_head == NULL) {
+			loop->fanout_tail = NULL;
+		}
+		put_broadcast(NULL, 0, link->broadcast);
+		loop->fanout_next = TAILQ_FIRST(&loop->subscribers);
+	}
+
+	if(loop->fanout_head != NULL && evtimer_add(&loop->fanout_event, &next_iteration)) {
+		ERROR_OUT("Error scheduling broadcasts on event loop %d.\n", loop->id);
+	}
+}
+
+// Moves broadcasts from the loop's inbox to its fanout queue
+static void take_broadcasts(struct cmdloop *loop)
+{
+	static const struct timeval next_iteration = { 0, 0 };
+	struct broadcast_link *head, *tail;
+
+	pthread_mutex_lock(&loop->inbox_lock);
+	head = loop->inbox_head;
+	tail = loop->inbox_tail;
+	loop->inbox_head = NULL;
+	loop->inbox_tail = NULL;
+	pthread_mutex_unlock(&loop->inbox_lock);
+
+	if(head == NULL) {
+		return;
+	}
+
+	if(loop->fanout_tail != NULL) {
+		loop->fanout_tail->next = head;
+	} else {
+		loop->fanout_head = head;
+		loop->fanout_next = TAILQ_FIRST(&loop->subscribers);
+	}
+	loop->fanout_tail = tail;
+
+	if(!evtimer_pending(&loop->fanout_event, NULL) && evtimer_add(&loop->fanout_event, &next_iteration)) {
+		ERROR_OUT("Error scheduling broadcasts on event loop %d.\n", loop->id);
+	}
+}
+
+// Drops the broadcasts in a list of links
+static void put_broadcast_links(struct broadcast_link *link)
+{
+	struct broadcast_link *next;
+
+	for(; link != NULL; link = next) {
+		next = link->next;
+		put_broadcast(NULL, 0, link->broadcast);
+	}
+}
+
+// Runs offloaded commands from the job queue, and returns each finished job
+// to the loop it came from, until stop_workers() is called.
+static void *worker_thread(void *arg)
+{
+	struct cmdloop *loop;
+	struct cmdjob *job;
+	int wake;
+
+	pthread_mutex_lock(&workers.lock);
+	for(;;) {
+		while(workers.head == NULL && !workers.stop) {
+			pthread_cond_wait(&workers.wake, &workers.lock);
+		}
+		if(workers.stop) {
+			break;
+		}
+
+		job = workers.head;
+		workers.head = job->next;
+		if(workers.head == NULL) {
+			workers.tail = NULL;
+		}
+		workers.busy++;
+		pthread_mutex_unlock(&workers.lock);
+
+		job->command->func(NULL, job->output, job->command, job->params, job->len);
+
+		// The loop only needs waking for the first job in its list
+		loop = job->loop;
+		job->next = NULL;
+		pthread_mutex_lock(&loop->done_lock);
+		wake = loop->done_head == NULL;
+		if(loop->done_tail != NULL) {
+			loop->done_tail->next = job;
+		} else {
+			loop->done_head = job;
+		}
+		loop->done_tail = job;
+		pthread_mutex_unlock(&loop->done_lock);
+
+		if(wake) {
+			wake_loop(loop, 0);
+		}
+
+		pthread_mutex_lock(&workers.lock);
+		workers.busy--;
+	}
+	pthread_mutex_unlock(&workers.lock);
+
+	return NULL;
+}
+
+// Starts config.workers worker threads.  Returns 0 on success, -1 on error
+// (offloaded commands then run on the threads that did start, or on the
+// event loops if none did).
+static int start_workers(void)
+{
+	if(config.workers == 0) {
+		return 0;
+	}
+
+	workers.threads = calloc(config.workers, sizeof(pthread_t));
+	if(workers.threads == NULL) {
+		ERRNO_OUT("Error allocating worker threads");
+		return -1;
+	}
+
+	for(workers.count = 0; workers.count < config.workers; workers.count++) {
+		errno = pthread_create(&workers.threads[workers.count], NULL, worker_thread, NULL);
+		if(errno) {
+			ERRNO_OUT("Error starting worker thread %zu", workers.count);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Stops the worker threads and discards the jobs that were still waiting.
+// Must be called after the event loops have stopped.  Returns the number of
+// workers still running a command, which aren't waited for: they may still
+// use the loops and the command set, so those must then be left for the
+// process's exit to free.
+static size_t stop_workers(void)
+{
+	struct cmdjob *job;
+	size_t busy;
+	size_t i;
+
+	pthread_mutex_lock(&workers.lock);
+	workers.stop = 1;
+	busy = workers.busy;
+	pthread_cond_broadcast(&workers.wake);
+	pthread_mutex_unlock(&workers.lock);
+
+	// The workers no longer take jobs from the queue
+	while((job = workers.head) != NULL) {
+		workers.head = job->next;
+		free_job(job);
+	}
+	workers.tail = NULL;
+
+	if(busy) {
+		INFO_OUT("Not waiting for %zu commands still running on worker threads.\n", busy);
+		return busy;
+	}
+
+	for(i = 0; i < workers.count; i++) {
+		errno = pthread_join(workers.threads[i], NULL);
+		if(errno) {
+			ERRNO_OUT("Error waiting for worker thread %zu to exit", i);
+		}
+	}
+	free(workers.threads);
+	workers.threads = NULL;
+	workers.count = 0;
+
+	return 0;
+}
+
+// Closes connections on the loop that have been idle for config.timeout
+// seconds.  Runs once per second, visiting the wheel slots that came due since
+// the last run.  Connections that were active since being put in a slot are
+// moved to the slot for their new deadline.
+static void wheel_tick(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	struct cmdsocket_queue due;
+	struct cmdsocket *cmdsocket;
+	time_t now = wheel_clock();
+	time_t t;
+
+	// Visit every slot that came due since the last tick (more than one if
+	// the loop was held up), but never go around the wheel more than once
+	t = loop->now + 1;
+	if(now - loop->now > WHEEL_SLOTS) {
+		t = now - WHEEL_SLOTS + 1;
+	}
+	loop->now = now;
+
+	for(; t <= now; t++) {
+		TAILQ_INIT(&due);
+		TAILQ_CONCAT(&due, &loop->wheel[t & (WHEEL_SLOTS - 1)], wheel_link);
+
+		while((cmdsocket = TAILQ_FIRST(&due)) != NULL) {
+			TAILQ_REMOVE(&due, cmdsocket, wheel_link);
+			cmdsocket->in_wheel = 0;
+
+			if(cmdsocket->last_active + (time_t)config.timeout <= now) {
+				INFO_OUT("Remote host on fd %d timed out.\n", cmdsocket->fd);
+				STAT_ADD(loop, timeouts, 1);
+				free_cmdsocket(cmdsocket);
+			} else {
+				wheel_insert(cmdsocket);
+			}
+		}
+	}
+}
+
+static void cmd_error(struct bufferevent *buf_event, short error, void *arg)
+{
+	struct cmdsocket *cmdsocket = (struct cmdsocket *)arg;
+
+	// A TLS bufferevent reports its finished handshake here too
+	if(error & BEV_EVENT_CONNECTED) {
+		tls_connected(cmdsocket);
+		return;
+	}
+
+	if(error & BEV_EVENT_EOF) {
+		INFO_OUT("Remote host disconnected from fd %d.\n", cmdsocket->fd);
+		cmdsocket->shutdown = 1;
+	} else if(error & BEV_EVENT_TIMEOUT) {
+		INFO_OUT("Remote host on fd %d timed out.\n", cmdsocket->fd);
+		STAT_ADD(cmdsocket->loop, timeouts, 1);
+	} else {
+		ERROR_OUT("A socket error (0x%hx) occurred on fd %d.\n", error, cmdsocket->fd);
+		if(buf_event != cmdsocket->sock_event) {
+			log_tls_errors(buf_event);
+		}
+		STAT_ADD(cmdsocket->loop, errors, 1);
+	}
+
+	free_cmdsocket(cmdsocket);
+}
+
+static void setup_connection(int sockfd, int local, struct cmdloop *loop)
+{
+	struct cmdsocket *cmdsocket;
+
+	cmdsocket = create_cmdsocket(sockfd, local, loop);
+	if(cmdsocket == NULL) {
+		ERROR_OUT("Error allocating command handler for fd %d.\n", sockfd);
+		close(sockfd);
+		return;
+	}
+
+	// Attach the buffered I/O event to the new socket (unless io_uring does
+	// the I/O, in which case the reads start when the prompt is flushed)
+	if(cmdsocket->uring != NULL) {
+		send_prompt(cmdsocket);
+		flush_cmdsocket(cmdsocket);
+		return;
+	}
+	if(config.tls_cert != NULL ? start_tls(cmdsocket) : bufferevent_setfd(cmdsocket->buf_event, sockfd)) {
+		ERROR_OUT("Error initializing buffered I/O event for fd %d.\n", sockfd);
+		free_cmdsocket(cmdsocket);
+		return;
+	}
+	if((rate_limits.client != NULL && bufferevent_set_rate_limit(cmdsocket->buf_event, rate_limits.client)) ||
+			(loop->rate_group != NULL &&
+			 bufferevent_add_to_rate_limit_group(cmdsocket->buf_event, loop->rate_group))) {
+		ERROR_OUT("Error setting rate limits for fd %d.\n", sockfd);
+		free_cmdsocket(cmdsocket);
+		return;
+	}
+	if(bufferevent_enable(cmdsocket->buf_event, EV_READ | EV_WRITE)) {
+		ERROR_OUT("Error enabling buffered I/O event for fd %d.\n", sockfd);
+		free_cmdsocket(cmdsocket);
+		return;
+	}
+
+	send_prompt(cmdsocket);
+	flush_cmdsocket(cmdsocket);
+}
+
+static void cmd_connect(int listenfd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	int sockfd;
+	int i;
+
+	if(!(evtype & EV_READ)) {
+		ERROR_OUT("Unknown event type in connect callback: 0x%hx\n", evtype);
+		return;
+	}
+	
+	// Accept and configure incoming connections (up to config.accept_budget
+	// connections in one go).  accept4() makes the new socket non-blocking
+	// without any extra system calls.
+	for(i = 0; i < config.accept_budget; i++) {
+		sockfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(sockfd < 0) {
+			if(errno != EWOULDBLOCK && errno != EAGAIN) {
+				ERRNO_OUT("Error accepting an incoming connection");
+				STAT_ADD(loop, errors, 1);
+			}
+			break;
+		}
+
+		INFO_OUT("Client connected on fd %d (loop %d)\n", sockfd, loop->id);
+
+		// Every listener but the TCP one is a UNIX socket
+		setup_connection(sockfd, listenfd != loop->listenfd, loop);
+	}
+}
+
+// Records how much data the loop's connections have buffered, for the stats.
+// Runs once per second on each loop.
+static void sample_buffers(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	struct cmdsocket *cmdsocket;
+	uint64_t total = 0, max = 0, len;
+	size_t i;
+
+	for(i = 0; i < loop->nconns; i++) {
+		cmdsocket = loop->conns[i];
+		len = pending_output(cmdsocket) + evbuffer_get_length(bufferevent_get_input(cmdsocket->buf_event));
+		total += len;
+		if(len > max) {
+			max = len;
+		}
+	}
+
+	__atomic_store_n(&loop->stats.buffered, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&loop->stats.buffered_max, max, __ATOMIC_RELAXED);
+}
+
+// Logs the loop's counters and its busiest open connection (the one that has
+// spent the most time running commands).  Runs every --stats-interval seconds
+// on each loop.
+static void log_stats(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	struct cmdsocket *cmdsocket, *busiest = NULL;
+	size_t i;
+
+	for(i = 0; i < loop->nconns; i++) {
+		cmdsocket = loop->conns[i];
+		if(busiest == NULL || cmdsocket->busy_ns > busiest->busy_ns) {
+			busiest = cmdsocket;
+		}
+	}
+
+	INFO_OUT("Loop %d: %llu open, %llu accepted, %llu timed out, %llu lines, %llu commands (%llu unknown), "
+			"%llu bytes in, %llu bytes out, %llu errors\n", loop->id,
+			(unsigned long long)(loop->stats.accepted - loop->stats.closed),
+			(unsigned long long)loop->stats.accepted,
+			(unsigned long long)loop->stats.timeouts,
+			(unsigned long long)loop->stats.lines,
+			(unsigned long long)loop->stats.commands,
+			(unsigned long long)loop->stats.unknown,
+			(unsigned long long)loop->stats.bytes_in,
+			(unsigned long long)loop->stats.bytes_out,
+			(unsigned long long)(loop->stats.errors + loop->stats.overlong));
+	if(busiest != NULL) {
+		INFO_OUT("Loop %d: busiest client is fd %d with %llu commands in %llu usec\n", loop->id,
+				busiest->fd, (unsigned long long)busiest->commands,
+				(unsigned long long)busiest->busy_ns / 1000);
+	}
+}
+
+// Asks every event loop to exit.  Safe to call from any thread.
+static void stop_server(void)
+{
+	int i;
+
+	for(i = 0; i < config.threads; i++) {
+		wake_loop(&loops[i], LOOP_STOP);
+	}
+}
+
+// Stops accepting from the loop's copies of the --unix listening sockets and
+// closes them.
+static void close_local_listeners(struct cmdloop *loop)
+{
+	size_t i;
+
+	for(i = 0; i < config.unix_count; i++) {
+		if(loop->localfds[i] >= 0) {
+			if(event_initialized(&loop->local_events[i])) {
+				event_del(&loop->local_events[i]);
+			}
+			if(close(loop->localfds[i])) {
+				ERRNO_OUT("Error closing UNIX listening socket for loop %d", loop->id);
+			}
+			loop->localfds[i] = -1;
+		}
+	}
+}
+
+// Starts draining the given loop: closes its listening sockets, closes the
+// clients that are idle now, and closes the others as soon as they have no
+// commands waiting and no output left to send.
+static void drain_loop(struct cmdloop *loop)
+{
+	struct timeval timeout = { config.drain_timeout, 0 };
+	size_t i;
+
+	if(loop->draining) {
+		return;
+	}
+	loop->draining = 1;
+	INFO_OUT("Draining event loop %d (%zu connections).\n", loop->id, loop->nconns);
+
+	if(loop->listenfd >= 0) {
+		event_del(&loop->connect_event);
+		uring_cancel_accept(loop);
+		if(close(loop->listenfd)) {
+			ERRNO_OUT("Error closing listening socket for loop %d", loop->id);
+		}
+		loop->listenfd = -1;
+	}
+	close_local_listeners(loop);
+
+	if(config.drain_timeout && evtimer_add(&loop->drain_timeout_event, &timeout)) {
+		ERROR_OUT("Error scheduling the drain timeout on event loop %d.\n", loop->id);
+	}
+
+	if(loop->nconns == 0) {
+		INFO_OUT("Event loop %d has finished draining.\n", loop->id);
+		event_base_loopexit(loop->evloop, NULL);
+		return;
+	}
+
+	// Freeing a connection moves the last one into its place, which has
+	// already been visited when walking the array backwards.  Freeing the
+	// last connection ends the loop.
+	for(i = loop->nconns; i-- > 0;) {
+		drain_cmdsocket(loop->conns[i]);
+	}
+}
+
+static void drain_expired(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+
+	INFO_OUT("Closing %zu connections still open on event loop %d after %zu seconds.\n",
+			loop->nconns, loop->id, config.drain_timeout);
+	event_base_loopexit(loop->evloop, NULL);
+}
+
+// Asks every event loop to drain (see drain_loop()).  Safe to call from any
+// thread.
+static void drain_server(void)
+{
+	int i;
+
+	__atomic_store_n(&draining, 1, __ATOMIC_RELAXED);
+
+	// Nobody else can take over once the listening sockets are closing
+	if(handoff.event != NULL && !handoff.handed_off) {
+		unlink(config.handoff);
+	}
+
+	for(i = 0; i < config.threads; i++) {
+		wake_loop(&loops[i], LOOP_DRAIN);
+	}
+}
+
+// Handles the loop's requests from other threads, and completes the jobs the
+// workers have finished for it.
+static void loop_wakeup(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	uint64_t count;
+	int requests;
+
+	if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		ERRNO_OUT("Error reading wakeups on event loop %d", loop->id);
+	}
+
+	requests = __atomic_exchange_n(&loop->requests, 0, __ATOMIC_ACQUIRE);
+	if(requests & LOOP_STOP) {
+		event_base_loopexit(loop->evloop, NULL);
+		return;
+	}
+
+	finish_jobs(loop);
+	take_broadcasts(loop);
+	if(requests & LOOP_RELOAD) {
+		put_cmdset(loop->cmds);
+		loop->cmds = get_cmdset();
+		DEBUG_OUT("Event loop %d is using the reloaded commands.\n", loop->id);
+	}
+	if(requests & LOOP_DRAIN) {
+		drain_loop(loop);
+	}
+}
+
+// The first SIGINT or SIGTERM drains the server; a second one stops it
+// immediately.
+static void sighandler(evutil_socket_t signal, short evtype, void *arg)
+{
+	if(__atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+		INFO_OUT("Received signal %d: %s.  Shutting down now.\n", signal, strsignal(signal));
+		stop_server();
+		return;
+	}
+
+	INFO_OUT("Received signal %d: %s.  Shutting down after sending pending output.\n", signal, strsignal(signal));
+	drain_server();
+}
+
+// Creates a non-blocking socket listening on the given port.  If reuseport is
+// nonzero, SO_REUSEPORT is set so that each event loop can bind its own socket
+// to the same port.  Returns the socket, or -1 on error.
+static int create_listener(unsigned short listenport, int reuseport)
+{
+	struct sockaddr_in6 local_addr;
+	int listenfd;
+	int tmp_reuse = 1;
+	int defer = config.defer_accept;
+
+	// Initialize socket address
+	memset(&local_addr, 0, sizeof(local_addr));
+	local_addr.sin6_family = AF_INET6;
+	local_addr.sin6_port = htons(listenport);
+	local_addr.sin6_addr = in6addr_any;
+
+	// Begin listening for connections
+	listenfd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(listenfd == -1) {
+		ERRNO_OUT("Error creating listening socket");
+		return -1;
+	}
+	if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &tmp_reuse, sizeof(tmp_reuse))) {
+		ERRNO_OUT("Error enabling socket address reuse on listening socket");
+		close(listenfd);
+		return -1;
+	}
+	if(reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &tmp_reuse, sizeof(tmp_reuse))) {
+		ERRNO_OUT("Error enabling socket port reuse on listening socket");
+		close(listenfd);
+		return -1;
+	}
+	if(bind(listenfd, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
+		ERRNO_OUT("Error binding listening socket");
+		close(listenfd);
+		return -1;
+	}
+	if(config.defer_accept && setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer))) {
+		ERRNO_OUT("Error enabling deferred accept on listening socket");
+		close(listenfd);
+		return -1;
+	}
+	if(listen(listenfd, config.backlog)) {
+		ERRNO_OUT("Error listening to listening socket");
+		close(listenfd);
+		return -1;
+	}
+
+	// Set socket for non-blocking I/O
+	if(set_nonblock(listenfd)) {
+		ERROR_OUT("Error setting listening socket to non-blocking I/O.\n");
+		close(listenfd);
+		return -1;
+	}
+
+	return listenfd;
+}
+
+// Fills in the address of the given --unix socket, which is in the abstract
+// namespace if the path starts with @.  Returns 0 on success, -1 if the path
+// doesn't fit.
+static int local_address(const char *path, struct sockaddr_un *addr, socklen_t *addrlen)
+{
+	size_t len = strlen(path);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(len == 0 || (path[0] == '@' && len == 1) || len >= sizeof(addr->sun_path)) {
+		ERROR_OUT("Invalid UNIX socket path: %s\n", path);
+		return -1;
+	}
+	memcpy(addr->sun_path, path, len);
+
+	// An abstract name starts with a NUL byte and runs to the end of the
+	// address instead of being NUL-terminated
+	if(path[0] == '@') {
+		addr->sun_path[0] = 0;
+		*addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+	} else {
+		*addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+	}
+
+	return 0;
+}
+
+// Returns 1 if nothing is listening on the UNIX socket at the given address
+// (so the socket file belongs to a server that has exited), 0 otherwise.
+// Leaves errno set to EADDRINUSE.
+static int stale_local_socket(const struct sockaddr_un *addr, socklen_t addrlen)
+{
+	int stale;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		errno = EADDRINUSE;
+		return 0;
+	}
+	stale = connect(fd, (const struct sockaddr *)addr, addrlen) && errno == ECONNREFUSED;
+	close(fd);
+
+	errno = EADDRINUSE;
+	return stale;
+}
+
+// Creates a non-blocking socket listening at the given --unix path, replacing
+// a socket file left behind by a server that is no longer running.  Returns
+// the socket, or -1 on error.
+static int create_local_listener(const char *path)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int listenfd;
+
+	if(local_address(path, &addr, &addrlen)) {
+		return -1;
+	}
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listenfd == -1) {
+		ERRNO_OUT("Error creating UNIX listening socket");
+		return -1;
+	}
+	if(bind(listenfd, (struct sockaddr *)&addr, addrlen) &&
+			(errno != EADDRINUSE || path[0] == '@' || !stale_local_socket(&addr, addrlen) ||
+			 unlink(path) || bind(listenfd, (struct sockaddr *)&addr, addrlen))) {
+		ERRNO_OUT("Error binding UNIX socket %s", path);
+		close(listenfd);
+		return -1;
+	}
+	if(listen(listenfd, config.backlog)) {
+		ERRNO_OUT("Error listening on UNIX socket %s", path);
+		close(listenfd);
+		return -1;
+	}
+
+	INFO_OUT("Listening on UNIX socket %s.\n", path);
+	return listenfd;
+}
+
+// Fills localfds with a listening socket for each --unix path, using the
+// ones taken over from a running server (in the nfds sockets in fds) where
+// the address matches and creating the rest.  Every UNIX socket is removed
+// from fds, and those that no longer match a --unix path are closed, so only
+// the TCP sockets are left.  Returns 0 on success, -1 on error.
+static int open_local_listeners(int *fds, int *nfds, int *localfds)
+{
+	struct sockaddr_un addr, bound;
+	socklen_t addrlen, boundlen;
+	int kept = 0;
+	size_t i;
+	int j;
+
+	for(i = 0; i < config.unix_count; i++) {
+		localfds[i] = -1;
+	}
+
+	for(j = 0; j < *nfds; j++) {
+		boundlen = sizeof(bound);
+		if(getsockname(fds[j], (struct sockaddr *)&bound, &boundlen) || bound.sun_family != AF_UNIX) {
+			fds[kept++] = fds[j];
+			continue;
+		}
+
+		for(i = 0; i < config.unix_count; i++) {
+			if(localfds[i] < 0 && !local_address(config.unix_paths[i], &addr, &addrlen) &&
+					addrlen == boundlen && !memcmp(&addr, &bound, addrlen)) {
+				localfds[i] = fds[j];
+				break;
+			}
+		}
+		if(i == config.unix_count) {
+			// Connections waiting on this socket are lost
+			INFO_OUT("Closing a UNIX listening socket that is no longer configured.\n");
+			close(fds[j]);
+		}
+	}
+	*nfds = kept;
+
+	for(i = 0; i < config.unix_count; i++) {
+		if(localfds[i] < 0) {
+			localfds[i] = create_local_listener(config.unix_paths[i]);
+			if(localfds[i] < 0) {
+				for(i = 0; i < config.unix_count; i++) {
+					if(localfds[i] >= 0) {
+						close(localfds[i]);
+					}
+				}
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Removes the socket files of the --unix listeners when the server exits,
+// unless a restarted server took them over and is listening on them now.
+static void remove_local_listeners(void)
+{
+	size_t i;
+
+	if(handoff.handed_off) {
+		return;
+	}
+	for(i = 0; i < config.unix_count; i++) {
+		if(config.unix_paths[i][0] != '@' && unlink(config.unix_paths[i]) && errno != ENOENT) {
+			ERRNO_OUT("Error removing UNIX socket %s", config.unix_paths[i]);
+		}
+	}
+}
+
+#ifdef HAVE_IO_URING
+
+static int uring_enter(int fd, unsigned int to_submit)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+// Hands the queued requests to the kernel
+static void uring_submit(struct cmdloop *loop)
+{
+	struct uring *uring = loop->uring;
+	int ret;
+
+	__atomic_store_n(uring->sq_ktail, uring->sq_tail, __ATOMIC_RELEASE);
+	while(uring->pending > 0) {
+		ret = uring_enter(uring->fd, uring->pending);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			// EBUSY means completions have to be reaped first; the
+			// rest are submitted after the next reap
+			if(errno != EBUSY && errno != EAGAIN) {
+				ERRNO_OUT("Error submitting io_uring requests on event loop %d", loop->id);
+			}
+			break;
+		}
+		uring->pending -= ret;
+	}
+}
+
+static void uring_submit_cb(evutil_socket_t fd, short evtype, void *arg)
+{
+	uring_submit(arg);
+}
+
+// Returns a zeroed submission queue entry with the given user_data, to be
+// submitted at the end of this event loop iteration, or NULL if the queue is
+// full.
+static struct io_uring_sqe *uring_sqe(struct cmdloop *loop, void *ptr, int op)
+{
+	struct uring *uring = loop->uring;
+	struct io_uring_sqe *sqe;
+
+	if(uring->sq_tail - __atomic_load_n(uring->sq_khead, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+		uring_submit(loop);
+		if(uring->sq_tail - __atomic_load_n(uring->sq_khead, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+			ERROR_OUT("The io_uring submission queue on event loop %d is full.\n", loop->id);
+			return NULL;
+		}
+	}
+
+	sqe = &uring->sqes[uring->sq_tail & uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)ptr | op;
+	uring->sq_tail++;
+
+	if(uring->pending++ == 0) {
+		event_active(&uring->submit_event, EV_WRITE, 0);
+	}
+
+	return sqe;
+}
+
+// Gives the read buffer with the given id back to the kernel
+static void uring_provide(struct uring *uring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_tail & (URING_BUFS - 1)];
+
+	buf->addr = (uintptr_t)(uring->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	uring->buf_tail++;
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Arms a multishot accept on the loop's listening socket.  Each accepted
+// connection completes separately, with no system call from the server.
+static void uring_accept(struct cmdloop *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	if(loop->uring->accepting || loop->listenfd < 0) {
+		return;
+	}
+
+	sqe = uring_sqe(loop, loop, URING_ACCEPT);
+	if(sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	loop->uring->accepting = 1;
+}
+
+// Cancels the multishot accept before the listening socket is closed (it
+// holds a reference to the socket that would keep it open)
+static void uring_cancel_accept(struct cmdloop *loop)
+{
+	struct io_uring_sqe *sqe;
+
+	if(loop->uring == NULL || !loop->uring->accepting) {
+		return;
+	}
+
+	sqe = uring_sqe(loop, NULL, URING_IGNORE);
+	if(sqe != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)loop | URING_ACCEPT;
+	}
+	uring_submit(loop);
+}
+
+// Cancels the request of the given type if the connection has one in flight
+static void uring_cancel(struct cmdsocket *cmdsocket, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(cmdsocket->loop, cmdsocket, URING_CANCEL);
+	if(sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)cmdsocket | op;
+	cmdsocket->uring->ops++;
+}
+
+// Starts or stops the connection's multishot recv, depending on whether the
+// client should be read from: like a bufferevent, it stops while the client is
+// paused or has config.read_high bytes waiting.
+static void uring_update_recv(struct cmdsocket *cmdsocket)
+{
+	struct cmdsocket_uring *state = cmdsocket->uring;
+	struct io_uring_sqe *sqe;
+	int want;
+
+	want = !cmdsocket->paused && !cmdsocket->shutdown &&
+		evbuffer_get_length(bufferevent_get_input(cmdsocket->buf_event)) < config.read_high;
+
+	if(want && !state->receiving) {
+		sqe = uring_sqe(cmdsocket->loop, cmdsocket, URING_RECV);
+		if(sqe == NULL) {
+			return;
+		}
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = cmdsocket->fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		state->receiving = 1;
+		state->ops++;
+	} else if(!want && state->receiving && !state->cancelling) {
+		uring_cancel(cmdsocket, URING_RECV);
+		state->cancelling = 1;
+	}
+}
+
+// Sends as much of the client's output as fits in one sendmsg(), unless a send
+// is already in flight
+static void uring_send(struct cmdsocket *cmdsocket)
+{
+	struct evbuffer *output = bufferevent_get_output(cmdsocket->buf_event);
+	struct cmdsocket_uring *state = cmdsocket->uring;
+	struct io_uring_sqe *sqe;
+	int count;
+
+	if(state->sending || evbuffer_get_length(output) == 0) {
+		return;
+	}
+
+	count = evbuffer_peek(output, -1, NULL, state->iov, URING_IOVS);
+	if(count > URING_IOVS) {
+		count = URING_IOVS;
+	}
+	memset(&state->msg, 0, sizeof(state->msg));
+	state->msg.msg_iov = state->iov;
+	state->msg.msg_iovlen = count;
+
+	sqe = uring_sqe(cmdsocket->loop, cmdsocket, URING_SEND);
+	if(sqe == NULL) {
+		return;
+	}
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = cmdsocket->fd;
+	sqe->addr = (uintptr_t)&state->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	state->sending = 1;
+	state->ops++;
+}
+
+// Queues the connection's reads and writes at the end of its turn
+static void uring_flush(struct cmdsocket *cmdsocket)
+{
+	if(cmdsocket->fd < 0) {
+		return;
+	}
+	uring_send(cmdsocket);
+	uring_update_recv(cmdsocket);
+}
+
+// Cancels the requests of a connection being closed.  Returns 1 if some are
+// still in flight (the cmdsocket is released once they complete), 0 if the
+// cmdsocket can be released now.
+static int uring_close(struct cmdsocket *cmdsocket)
+{
+	struct cmdsocket_uring *state = cmdsocket->uring;
+
+	if(state->receiving && !state->cancelling) {
+		uring_cancel(cmdsocket, URING_RECV);
+		state->cancelling = 1;
+	}
+	if(state->sending) {
+		uring_cancel(cmdsocket, URING_SEND);
+	}
+
+	return state->ops > 0;
+}
+
+// Finishes with one of a connection's requests, releasing a closed cmdsocket
+// once its last request is done
+static void uring_put(struct cmdsocket *cmdsocket)
+{
+	if(--cmdsocket->uring->ops == 0 && cmdsocket->fd < 0) {
+		release_cmdsocket(cmdsocket);
+	}
+}
+
+static void uring_accepted(struct cmdloop *loop, int res, unsigned int flags)
+{
+	if(!(flags & IORING_CQE_F_MORE)) {
+		loop->uring->accepting = 0;
+	}
+
+	if(res >= 0) {
+		INFO_OUT("Client connected on fd %d (loop %d)\n", res, loop->id);
+		setup_connection(res, 0, loop);
+	} else if(res != -ECANCELED) {
+		errno = -res;
+		ERRNO_OUT("Error accepting an incoming connection");
+		STAT_ADD(loop, errors, 1);
+	}
+
+	if(!loop->draining) {
+		uring_accept(loop);
+	}
+}
+
+static void uring_received(struct cmdsocket *cmdsocket, int res, unsigned int flags)
+{
+	struct cmdsocket_uring *state = cmdsocket->uring;
+	struct uring *uring = cmdsocket->loop->uring;
+	unsigned short bid;
+
+	if(!(flags & IORING_CQE_F_MORE)) {
+		state->receiving = 0;
+		state->cancelling = 0;
+	}
+
+	if(flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if(res > 0 && cmdsocket->fd >= 0) {
+			evbuffer_add(bufferevent_get_input(cmdsocket->buf_event), uring->bufs + (size_t)bid * URING_BUF_SIZE, res);
+		}
+		uring_provide(uring, bid);
+	}
+
+	if(cmdsocket->fd < 0) {
+		// The connection was closed while this was in flight
+	} else if(res > 0) {
+		cmd_read(cmdsocket->buf_event, cmdsocket);
+	} else if(res == 0) {
+		cmd_error(cmdsocket->buf_event, BEV_EVENT_READING | BEV_EVENT_EOF, cmdsocket);
+	} else if(res != -ECANCELED && res != -ENOBUFS) {
+		errno = -res;
+		ERRNO_OUT("Error reading from fd %d", cmdsocket->fd);
+		cmd_error(cmdsocket->buf_event, BEV_EVENT_READING | BEV_EVENT_ERROR, cmdsocket);
+	}
+
+	// A recv that ran out of buffers or was stopped is rearmed if the
+	// client should still be read from
+	if(cmdsocket->fd >= 0) {
+		uring_update_recv(cmdsocket);
+	}
+	if(!(flags & IORING_CQE_F_MORE)) {
+		uring_put(cmdsocket);
+	}
+}
+
+static void uring_sent(struct cmdsocket *cmdsocket, int res)
+{
+	cmdsocket->uring->sending = 0;
+
+	if(cmdsocket->fd < 0) {
+		// The connection was closed while this was in flight
+	} else if(res < 0) {
+		errno = -res;
+		ERRNO_OUT("Error writing to fd %d", cmdsocket->fd);
+		cmd_error(cmdsocket->buf_event, BEV_EVENT_WRITING | BEV_EVENT_ERROR, cmdsocket);
+	} else {
+		evbuffer_drain(bufferevent_get_output(cmdsocket->buf_event), res);
+
+		// Like the bufferevent's write watermark
+		if(pending_output(cmdsocket) <= config.write_low) {
+			cmd_write(cmdsocket->buf_event, cmdsocket);
+		}
+		if(cmdsocket->fd >= 0) {
+			uring_send(cmdsocket);
+		}
+	}
+
+	uring_put(cmdsocket);
+}
+
+// Handles the completions waiting in the loop's ring, then submits the
+// requests they queued
+static void uring_reap(evutil_socket_t fd, short evtype, void *arg)
+{
+	struct cmdloop *loop = arg;
+	struct uring *uring = loop->uring;
+	struct io_uring_cqe *cqe;
+	unsigned int head, flags;
+	uint64_t user_data;
+	void *ptr;
+	int res;
+
+	head = *uring->cq_khead;
+	while(head != __atomic_load_n(uring->cq_ktail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring->cqes[head & uring->cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		head++;
+		__atomic_store_n(uring->cq_khead, head, __ATOMIC_RELEASE);
+
+		ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+		switch(user_data & URING_OP_MASK) {
+			case URING_ACCEPT:
+				uring_accepted(ptr, res, flags);
+				break;
+
+			case URING_RECV:
+				uring_received(ptr, res, flags);
+				break;
+
+			case URING_SEND:
+				uring_sent(ptr, res);
+				break;
+
+			case URING_CANCEL:
+				uring_put(ptr);
+				break;
+		}
+	}
+
+	uring_submit(loop);
+}
+
+// Sets up an io_uring instance for the loop, with its read buffers.  Returns 0
+// on success, -1 on error.
+static int uring_init(struct cmdloop *loop)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	struct uring *uring;
+	unsigned int i;
+
+	uring = calloc(1, sizeof(struct uring));
+	if(uring == NULL) {
+		ERRNO_OUT("Error allocating io_uring for event loop %d", loop->id);
+		return -1;
+	}
+	loop->uring = uring;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_ENTRIES * 4;
+	uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if(uring->fd < 0) {
+		ERRNO_OUT("Error creating io_uring for event loop %d", loop->id);
+		return -1;
+	}
+
+	uring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(uring->cq_ring_len > uring->sq_ring_len) {
+			uring->sq_ring_len = uring->cq_ring_len;
+		}
+		uring->cq_ring_len = 0;
+	}
+	uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			uring->fd, IORING_OFF_SQ_RING);
+	if(uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		ERRNO_OUT("Error mapping io_uring submission queue for event loop %d", loop->id);
+		return -1;
+	}
+	uring->cq_ring = uring->sq_ring;
+	if(uring->cq_ring_len) {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				uring->fd, IORING_OFF_CQ_RING);
+		if(uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			ERRNO_OUT("Error mapping io_uring completion queue for event loop %d", loop->id);
+			return -1;
+		}
+	}
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			uring->fd, IORING_OFF_SQES);
+	if(uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		ERRNO_OUT("Error mapping io_uring submission entries for event loop %d", loop->id);
+		return -1;
+	}
+
+	uring->sq_khead = (unsigned int *)((char *)uring->sq_ring + params.sq_off.head);
+	uring->sq_ktail = (unsigned int *)((char *)uring->sq_ring + params.sq_off.tail);
+	uring->sq_mask = *(unsigned int *)((char *)uring->sq_ring + params.sq_off.ring_mask);
+	uring->sq_entries = params.sq_entries;
+	uring->sq_tail = *uring->sq_ktail;
+	for(i = 0; i < params.sq_entries; i++) {
+		((unsigned int *)((char *)uring->sq_ring + params.sq_off.array))[i] = i;
+	}
+	uring->cq_khead = (unsigned int *)((char *)uring->cq_ring + params.cq_off.head);
+	uring->cq_ktail = (unsigned int *)((char *)uring->cq_ring + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *)((char *)uring->cq_ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ring + params.cq_off.cqes);
+
+	// The buffer ring has to be page aligned
+	uring->buf_ring_len = URING_BUFS * sizeof(struct io_uring_buf);
+	uring->buf_ring = mmap(NULL, uring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(uring->buf_ring == MAP_FAILED) {
+		uring->buf_ring = NULL;
+		ERRNO_OUT("Error allocating io_uring buffer ring for event loop %d", loop->id);
+		return -1;
+	}
+	uring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	if(uring->bufs == NULL) {
+		ERRNO_OUT("Error allocating io_uring read buffers for event loop %d", loop->id);
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)uring->buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = 0;
+	if(syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		ERRNO_OUT("Error registering io_uring read buffers for event loop %d", loop->id);
+		return -1;
+	}
+	for(i = 0; i < URING_BUFS; i++) {
+		uring_provide(uring, i);
+	}
+
+	event_assign(&uring->submit_event, loop->evloop, -1, 0, uring_submit_cb, loop);
+	event_assign(&uring->cq_event, loop->evloop, uring->fd, EV_READ | EV_PERSIST, uring_reap, loop);
+	if(event_add(&uring->cq_event, NULL)) {
+		ERROR_OUT("Error scheduling io_uring completion event on event loop %d.\n", loop->id);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Closes the loop's ring, which cancels any requests still in flight.  Must be
+// called before the loop's connection pool is freed.
+static void uring_free(struct cmdloop *loop)
+{
+	struct uring *uring = loop->uring;
+
+	if(uring == NULL) {
+		return;
+	}
+
+	if(event_initialized(&uring->cq_event)) {
+		event_del(&uring->cq_event);
+	}
+	if(event_initialized(&uring->submit_event)) {
+		event_del(&uring->submit_event);
+	}
+	if(uring->fd >= 0) {
+		close(uring->fd);
+	}
+	if(uring->sqes != NULL) {
+		munmap(uring->sqes, uring->sqes_len);
+	}
+	if(uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+		munmap(uring->cq_ring, uring->cq_ring_len);
+	}
+	if(uring->sq_ring != NULL) {
+		munmap(uring->sq_ring, uring->sq_ring_len);
+	}
+	if(uring->buf_ring != NULL) {
+		munmap(uring->buf_ring, uring->buf_ring_len);
+	}
+	free(uring->bufs);
+	free(uring);
+	loop->uring = NULL;
+}
+
+#else /* HAVE_IO_URING */
+
+// Without io_uring support, loop->uring and cmdsocket->uring are always NULL
+static int uring_init(struct cmdloop *loop)
+{
+	ERROR_OUT("This server was built without io_uring support.\n");
+	return -1;
+}
+
+static void uring_free(struct cmdloop *loop)
+{
+}
+
+static void uring_accept(struct cmdloop *loop)
+{
+}
+
+static void uring_cancel_accept(struct cmdloop *loop)
+{
+}
+
+static void uring_flush(struct cmdsocket *cmdsocket)
+{
+}
+
+static int uring_close(struct cmdsocket *cmdsocket)
+{
+	return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_TLS
+
+// Number of sessions kept for clients that resume a TLS 1.2 session by id,
+// and the seconds a session (or session ticket) can be resumed for
+#define TLS_SESSION_CACHE	20480
+#define TLS_SESSION_TIMEOUT	7200
+
+// The TLS settings shared by every loop, or NULL without --tls-cert
+static SSL_CTX *tls_ctx;
+
+// Logs and clears the OpenSSL errors recorded by the given TLS bufferevent,
+// or the calling thread's OpenSSL errors if buf_event is NULL.
+static void log_tls_errors(struct bufferevent *buf_event)
+{
+	unsigned long err;
+	char msg[256];
+
+	while((err = buf_event != NULL ? bufferevent_get_openssl_error(buf_event) : ERR_get_error()) != 0) {
+		// libevent records SSL_get_error() results among the real errors
+		if(ERR_GET_LIB(err) == 0) {
+			continue;
+		}
+		ERR_error_string_n(err, msg, sizeof(msg));
+		ERROR_OUT("TLS error: %s\n", msg);
+	}
+}
+
+static void free_tls(void)
+{
+	if(tls_ctx != NULL) {
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+	}
+}
+
+// Loads the --tls-cert certificate chain and key and sets up session
+// resumption and kernel TLS.  Returns 0 on success (or if TLS isn't
+// configured), -1 on error.
+static int init_tls(void)
+{
+	static const unsigned char session_context[] = "cliserver";
+	const char *key = config.tls_key != NULL ? config.tls_key : config.tls_cert;
+
+	if(config.tls_cert == NULL) {
+		return 0;
+	}
+
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if(CHECK_NULL(tls_ctx)) {
+		log_tls_errors(NULL);
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+
+	if(SSL_CTX_use_certificate_chain_file(tls_ctx, config.tls_cert) != 1 ||
+			SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(tls_ctx) != 1) {
+		ERROR_OUT("Error loading TLS certificate %s and key %s.\n", config.tls_cert, key);
+		log_tls_errors(NULL);
+		free_tls();
+		return -1;
+	}
+
+	// A reconnecting client skips the key exchange by resuming its
+	// session, either from a session ticket (encrypted with a key OpenSSL
+	// generates at startup, so the server keeps no state) or by id from
+	// the session cache, which every loop shares
+	SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE);
+	SSL_CTX_set_timeout(tls_ctx, TLS_SESSION_TIMEOUT);
+	SSL_CTX_set_session_id_context(tls_ctx, session_context, sizeof(session_context) - 1);
+
+	// Idle connections hand their record buffers back to OpenSSL
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_RELEASE_BUFFERS);
+
+	// OpenSSL 3 reports a client that disconnects without a close_notify
+	// alert as an error, which libevent doesn't recognize as a dirty
+	// shutdown
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+	// With kTLS, the keys are handed to the kernel after the handshake and
+	// the socket encrypts what SSL_write() passes it, so output isn't
+	// copied into a separate buffer of records first.  OpenSSL falls back
+	// to user space if the kernel can't do it for the negotiated cipher.
+	if(config.ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#else
+		ERROR_OUT("This version of OpenSSL doesn't support kernel TLS.\n");
+#endif
+	}
+
+	return 0;
+}
+
+// Replaces the connection's pooled bufferevent with one that does a TLS
+// handshake with the client and encrypts everything that follows.  The new
+// bufferevent owns the socket and closes it when it is freed.  Returns 0 on
+// success, -1 on error.
+static int start_tls(struct cmdsocket *cmdsocket)
+{
+	struct bufferevent *buf_event;
+	SSL *ssl;
+
+	ssl = SSL_new(tls_ctx);
+	if(CHECK_NULL(ssl)) {
+		log_tls_errors(NULL);
+		return -1;
+	}
+
+	buf_event = bufferevent_openssl_socket_new(cmdsocket->loop->evloop, cmdsocket->fd, ssl,
+			BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	if(CHECK_NULL(buf_event)) {
+		SSL_free(ssl);
+		return -1;
+	}
+
+	// A client that disconnects without a close_notify alert has simply
+	// disconnected, as it would without TLS
+	bufferevent_openssl_set_allow_dirty_shutdown(buf_event, 1);
+
+	bufferevent_setcb(buf_event, cmd_read, cmd_write, cmd_error, cmdsocket);
+	bufferevent_setwatermark(buf_event, EV_READ, 0, config.read_high);
+	bufferevent_setwatermark(buf_event, EV_WRITE, config.write_low, 0);
+
+	cmdsocket->buf_event = buf_event;
+	return 0;
+}
+
+// Sends a close_notify alert if the handshake has finished and the socket is
+// still open, then frees the connection's TLS bufferevent along with its
+// socket (once the bufferevent's callback returns, if one is running).  The
+// cmdsocket goes back to its pooled bufferevent.
+static void close_tls(struct cmdsocket *cmdsocket)
+{
+	SSL *ssl = bufferevent_openssl_get_ssl(cmdsocket->buf_event);
+
+	bufferevent_disable(cmdsocket->buf_event, EV_READ | EV_WRITE);
+	if(!cmdsocket->shutdown && SSL_is_init_finished(ssl)) {
+		SSL_shutdown(ssl);
+		ERR_clear_error();
+	}
+	shutdown_cmdsocket(cmdsocket);
+
+	bufferevent_free(cmdsocket->buf_event);
+	cmdsocket->buf_event = cmdsocket->sock_event;
+	cmdsocket->fd = -1;
+}
+
+// Counts a finished handshake, whether it resumed a session, and whether the
+// kernel took over encryption.
+static void tls_connected(struct cmdsocket *cmdsocket)
+{
+	SSL *ssl = bufferevent_openssl_get_ssl(cmdsocket->buf_event);
+
+	if(ssl == NULL) {
+		return;
+	}
+
+	STAT_ADD(cmdsocket->loop, tls_handshakes, 1);
+	if(SSL_session_reused(ssl)) {
+		STAT_ADD(cmdsocket->loop, tls_resumed, 1);
+	}
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+		STAT_ADD(cmdsocket->loop, tls_ktls, 1);
+	}
+
+	DEBUG_OUT("TLS handshake finished on fd %d: %s %s%s\n", cmdsocket->fd,
+			SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+			SSL_session_reused(ssl) ? " (resumed)" : "");
+}
+
+// Prints the connection's TLS version and cipher for the info command.
+static void tls_info(struct cmdsocket *cmdsocket, struct evbuffer *out)
+{
+	SSL *ssl;
+
+	if(cmdsocket->buf_event == cmdsocket->sock_event) {
+		return;
+	}
+
+	ssl = bufferevent_openssl_get_ssl(cmdsocket->buf_event);
+	evbuffer_add_printf(out, "TLS: %s %s%s%s\n", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+			SSL_session_reused(ssl) ? ", resumed" : "",
+			BIO_get_ktls_send(SSL_get_wbio(ssl)) ? ", kTLS" : "");
+}
+
+#else /* HAVE_TLS */
+
+static int init_tls(void)
+{
+	return 0;
+}
+
+static void free_tls(void)
+{
+}
+
+static int start_tls(struct cmdsocket *cmdsocket)
+{
+	return -1;
+}
+
+static void close_tls(struct cmdsocket *cmdsocket)
+{
+}
+
+static void tls_connected(struct cmdsocket *cmdsocket)
+{
+}
+
+static void tls_info(struct cmdsocket *cmdsocket, struct evbuffer *out)
+{
+}
+
+static void log_tls_errors(struct bufferevent *buf_event)
+{
+}
+
+#endif /* HAVE_TLS */
+
+// Returns token bucket settings for rate bytes per second in each direction,
+// with up to one second's worth in a burst, or NULL on error.
+static struct ev_token_bucket_cfg *new_rate_cfg(size_t rate)
+{
+	static const struct timeval tick = { 0, 1000000 / RATE_TICKS };
+	size_t per_tick = (rate + RATE_TICKS - 1) / RATE_TICKS;
+	struct ev_token_bucket_cfg *cfg;
+
+	cfg = ev_token_bucket_cfg_new(per_tick, rate, per_tick, rate, &tick);
+	if(CHECK_NULL(cfg)) {
+		ERROR_OUT("Error creating rate limit of %zu bytes per second.\n", rate);
+	}
+	return cfg;
+}
+
+// Creates the token bucket settings for --rate and --global-rate.  Must be
+// called once the number of loops is known.  Returns 0 on success, -1 on
+// error.
+static int init_rate_limits(void)
+{
+	size_t share;
+
+	if(config.rate) {
+		rate_limits.client = new_rate_cfg(config.rate);
+		if(rate_limits.client == NULL) {
+			return -1;
+		}
+	}
+
+	if(config.global_rate) {
+		share = config.global_rate / config.threads;
+		rate_limits.loop = new_rate_cfg(share ? share : 1);
+		if(rate_limits.loop == NULL) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void free_rate_limits(void)
+{
+	if(rate_limits.client != NULL) {
+		ev_token_bucket_cfg_free(rate_limits.client);
+		rate_limits.client = NULL;
+	}
+	if(rate_limits.loop != NULL) {
+		ev_token_bucket_cfg_free(rate_limits.loop);
+		rate_limits.loop = NULL;
+	}
+}
+
+// Creates an event base for one loop, on the fastest backend libevent has,
+// without locks.  Returns NULL on error.
+static struct event_base *new_event_base(void)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+
+	cfg = event_config_new();
+	if(CHECK_NULL(cfg)) {
+		return NULL;
+	}
+
+	// Each base is only used by its own thread; other threads go through
+	// wake_loop().  The epoll changelist turns the event changes made
+	// during an iteration into one epoll_ctl() per descriptor.
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+
+	// Prefer a backend whose cost doesn't grow with the number of
+	// connections, but make do with any backend if there isn't one
+	event_config_require_features(cfg, EV_FEATURE_O1);
+	base = event_base_new_with_config(cfg);
+	if(base == NULL) {
+		event_config_require_features(cfg, 0);
+		base = event_base_new_with_config(cfg);
+	}
+
+	event_config_free(cfg);
+	return base;
+}
+
+// Creates the given loop's event base and listening sockets.  If listenfd is
+// not -1, it is used as the TCP listening socket instead of creating a new
+// one (if --port isn't 0).  localfds holds the --unix listening sockets.
+// Returns 0 on success, -1 on error.
+static int init_cmdloop(struct cmdloop *loop, int id, int listenfd, const int *localfds)
+{
+	static const struct timeval wheel_interval = { 1, 0 };
+	struct timeval stats_interval = { 0, 0 };
+	size_t j;
+	int i;
+
+	loop->id = id;
+	loop->cpu = config.ncpus ? config.cpus[id % config.ncpus] : -1;
+	loop->listenfd = -1;
+	for(j = 0; j < MAX_LOCAL_LISTENERS; j++) {
+		loop->localfds[j] = -1;
+	}
+	loop->wake_fd = -1;
+	errno = pthread_mutex_init(&loop->done_lock, NULL);
+	if(errno) {
+		ERRNO_OUT("Error initializing job lock for event loop %d", id);
+		return -1;
+	}
+	errno = pthread_mutex_init(&loop->inbox_lock, NULL);
+	if(errno) {
+		ERRNO_OUT("Error initializing broadcast lock for event loop %d", id);
+		pthread_mutex_destroy(&loop->done_lock);
+		return -1;
+	}
+	loop->locks_ready = 1;
+
+	loop->evloop = new_event_base();
+	if(CHECK_NULL(loop->evloop)) {
+		ERROR_OUT("Error initializing event loop %d.\n", id);
+		return -1;
+	}
+
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(loop->wake_fd < 0) {
+		ERRNO_OUT("Error creating wakeup eventfd for event loop %d", id);
+		return -1;
+	}
+	event_assign(&loop->wake_event, loop->evloop, loop->wake_fd, EV_READ | EV_PERSIST, loop_wakeup, loop);
+	if(event_add(&loop->wake_event, NULL)) {
+		ERROR_OUT("Error scheduling wakeup event on event loop %d.\n", id);
+		return -1;
+	}
+
+	TAILQ_INIT(&loop->ready_queue);
+	evtimer_assign(&loop->ready_event, loop->evloop, serve_ready, loop);
+	TAILQ_INIT(&loop->throttle_queue);
+	evtimer_assign(&loop->throttle_event, loop->evloop, release_throttled, loop);
+	TAILQ_INIT(&loop->subscribers);
+	evtimer_assign(&loop->fanout_event, loop->evloop, fanout_broadcasts, loop);
+
+	if(rate_limits.loop != NULL) {
+		loop->rate_group = bufferevent_rate_limit_group_new(loop->evloop, rate_limits.loop);
+		if(CHECK_NULL(loop->rate_group)) {
+			ERROR_OUT("Error creating rate limit group for event loop %d.\n", id);
+			return -1;
+		}
+	}
+
+	for(i = 0; i < WHEEL_SLOTS; i++) {
+		TAILQ_INIT(&loop->wheel[i]);
+	}
+	loop->now = wheel_clock();
+	event_assign(&loop->wheel_event, loop->evloop, -1, EV_PERSIST, wheel_tick, loop);
+	if(config.timeout && event_add(&loop->wheel_event, &wheel_interval)) {
+		ERROR_OUT("Error scheduling the timeout wheel on event loop %d.\n", id);
+		return -1;
+	}
+
+	event_assign(&loop->sample_event, loop->evloop, -1, EV_PERSIST, sample_buffers, loop);
+	if(event_add(&loop->sample_event, &wheel_interval)) {
+		ERROR_OUT("Error scheduling buffer sampling on event loop %d.\n", id);
+		return -1;
+	}
+
+	evtimer_assign(&loop->drain_timeout_event, loop->evloop, drain_expired, loop);
+
+	event_assign(&loop->stats_event, loop->evloop, -1, EV_PERSIST, log_stats, loop);
+	if(config.stats_interval) {
+		stats_interval.tv_sec = config.stats_interval;
+		if(event_add(&loop->stats_event, &stats_interval)) {
+			ERROR_OUT("Error scheduling statistics on event loop %d.\n", id);
+			return -1;
+		}
+	}
+
+	loop->linebuf = malloc(config.max_line);
+	if(loop->linebuf == NULL) {
+		ERRNO_OUT("Error allocating line buffer for event loop %d", id);
+		return -1;
+	}
+
+	loop->reply = evbuffer_new();
+	if(CHECK_NULL(loop->reply)) {
+		ERROR_OUT("Error creating reply buffer for event loop %d.\n", id);
+		return -1;
+	}
+	loop->cmds = get_cmdset();
+
+	if(config.trace) {
+		loop->traces = calloc(TRACE_SLOTS, sizeof(struct trace_slot));
+		if(loop->traces == NULL) {
+			ERRNO_OUT("Error allocating trace ring for event loop %d", id);
+			return -1;
+		}
+		loop->trace_countdown = config.trace;
+	}
+
+	if(config.io_uring && uring_init(loop)) {
+		return -1;
+	}
+
+	// A pinned loop's pool is allocated by its own thread (see run_cmdloop())
+	if(config.pool_size && loop->cpu < 0 && grow_pool(loop, config.pool_size)) {
+		return -1;
+	}
+
+	// A restarted server may run a different number of loops, so sockets
+	// must share the port whenever they might be handed off
+	loop->listenfd = listenfd;
+	if(loop->listenfd < 0 && config.port) {
+		loop->listenfd = create_listener(config.port, config.threads > 1 || config.handoff != NULL);
+		if(loop->listenfd < 0) {
+			return -1;
+		}
+	}
+
+	// On Linux 6.2 and later, SO_REUSEPORT prefers the socket whose
+	// incoming CPU matches the CPU that received the connection
+	if(loop->listenfd >= 0 && loop->cpu >= 0 &&
+			setsockopt(loop->listenfd, SOL_SOCKET, SO_INCOMING_CPU, &loop->cpu, sizeof(loop->cpu))) {
+		ERRNO_OUT("Error setting the incoming CPU of event loop %d's listening socket", id);
+		return -1;
+	}
+
+	// Add an event to wait for connections (or let io_uring accept them)
+	if(loop->listenfd >= 0) {
+		event_assign(&loop->connect_event, loop->evloop, loop->listenfd, EV_READ | EV_PERSIST, cmd_connect, loop);
+		if(loop->uring != NULL) {
+			uring_accept(loop);
+		} else if(event_add(&loop->connect_event, NULL)) {
+			ERROR_OUT("Error scheduling connection event on event loop %d.\n", id);
+			return -1;
+		}
+	}
+
+	// Every loop accepts local clients too: loop 0 from the sockets in
+	// localfds, and the others from duplicates, so that each loop can close
+	// its own copy when it drains.  These are always accepted by
+	// cmd_connect(), even with io_uring.
+	for(j = 0; j < config.unix_count; j++) {
+		loop->localfds[j] = id == 0 ? localfds[j] : fcntl(localfds[j], F_DUPFD_CLOEXEC, 0);
+		if(loop->localfds[j] < 0) {
+			ERRNO_OUT("Error duplicating UNIX listening socket for event loop %d", id);
+			return -1;
+		}
+		event_assign(&loop->local_events[j], loop->evloop, loop->localfds[j], EV_READ | EV_PERSIST, cmd_connect, loop);
+		if(event_add(&loop->local_events[j], NULL)) {
+			ERROR_OUT("Error scheduling UNIX connection event on event loop %d.\n", id);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Frees a loop, including one whose init_cmdloop() failed part way (the
+// loops are zeroed when allocated, so unassigned events are skipped).
+static void free_cmdloop(struct cmdloop *loop)
+{
+	struct event *events[] = {
+		&loop->connect_event, &loop->ready_event, &loop->throttle_event,
+		&loop->fanout_event, &loop->wheel_event, &loop->stats_event,
+		&loop->sample_event, &loop->drain_timeout_event, &loop->wake_event,
+	};
+	struct cmdjob *job;
+	size_t i;
+
+	for(i = 0; i < ARRAY_SIZE(events); i++) {
+		if(event_initialized(events[i]) && event_del(events[i])) {
+			ERROR_OUT("Error removing event %zu from event loop %d.\n", i, loop->id);
+		}
+	}
+	if(loop->listenfd >= 0 && close(loop->listenfd)) {
+		ERRNO_OUT("Error closing listening socket for loop %d", loop->id);
+	}
+	close_local_listeners(loop);
+	if(loop->wake_fd >= 0) {
+		close(loop->wake_fd);
+	}
+	if(loop->locks_ready) {
+		pthread_mutex_destroy(&loop->done_lock);
+		pthread_mutex_destroy(&loop->inbox_lock);
+	}
+	while((job = loop->done_head) != NULL) {
+		loop->done_head = job->next;
+		free_job(job);
+	}
+	put_broadcast_links(loop->inbox_head);
+	put_broadcast_links(loop->fanout_head);
+	uring_free(loop);
+	free_pool(loop);
+	if(loop->rate_group != NULL) {
+		bufferevent_rate_limit_group_free(loop->rate_group);
+	}
+	free(loop->linebuf);
+	if(loop->reply != NULL) {
+		evbuffer_free(loop->reply);
+	}
+	while(loop->nspare_outputs > 0) {
+		evbuffer_free(loop->spare_outputs[--loop->nspare_outputs]);
+	}
+	free(loop->traces);
+	if(loop->cmds != NULL) {
+		put_cmdset(loop->cmds);
+	}
+	if(loop->evloop != NULL) {
+		event_base_free(loop->evloop);
+	}
+}
+
+// Attaches a classic BPF program to the loops' SO_REUSEPORT group of TCP
+// listeners that picks, for each new connection, the loop pinned to the CPU
+// that received it (or loop CPU % threads if none is).  The program returns a
+// position in the group, which lists the sockets in the order they joined it:
+// loop order, since each loop in turn creates or inherits its listener.
+// Returns 0 on success, -1 on error.
+static int steer_connections(void)
+{
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	size_t len = 0;
+	int ret = 0;
+	int i;
+
+	code = calloc(2 * config.threads + 3, sizeof(struct sock_filter));
+	if(code == NULL) {
+		ERRNO_OUT("Error allocating connection steering program");
+		return -1;
+	}
+
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for(i = 0; i < config.threads; i++) {
+		if(loops[i].cpu >= 0) {
+			code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, loops[i].cpu, 0, 1);
+			code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+		}
+	}
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, config.threads);
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	prog.len = len;
+	prog.filter = code;
+	if(setsockopt(loops[0].listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+		ERRNO_OUT("Error attaching connection steering program");
+		ret = -1;
+	}
+
+	free(code);
+	return ret;
+}
+
+// Sends every loop's listening socket to a restarted server that connected to
+// the handoff socket, then drains this server.  The new server accepts
+// connections from the same sockets, so none waiting to be accepted are lost.
+static void handoff_connect(evutil_socket_t fd, short evtype, void *arg)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 1024)];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t count = 0;
+	int fds[1024];
+	int sockfd;
+	int i;
+
+	sockfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if(sockfd < 0) {
+		if(errno != EWOULDBLOCK && errno != EAGAIN) {
+			ERRNO_OUT("Error accepting a handoff connection");
+		}
+		return;
+	}
+
+	// Listening sockets are only closed by draining, which doesn't start
+	// until the handoff is done
+	if(!__atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+		for(i = 0; i < config.threads; i++) {
+			if(loops[i].listenfd >= 0) {
+				fds[count++] = loops[i].listenfd;
+			}
+		}
+		for(i = 0; i < config.unix_count; i++) {
+			fds[count++] = loops[0].localfds[i];
+		}
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &count;
+	iov.iov_len = sizeof(count);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(count > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+
+	if(sendmsg(sockfd, &msg, MSG_NOSIGNAL) != sizeof(count)) {
+		ERRNO_OUT("Error sending listening sockets to a new server");
+		close(sockfd);
+		return;
+	}
+	close(sockfd);
+
+	if(count > 0) {
+		INFO_OUT("Handed %u listening sockets to a new server.\n", count);
+		handoff.handed_off = 1;
+		event_del(handoff.event);
+		drain_server();
+	}
+}
+
+// Starts listening for restarted servers on the UNIX socket at config.handoff,
+// using loop 0.  Returns 0 on success, -1 on error.
+static int listen_handoff(void)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(config.handoff) >= sizeof(addr.sun_path)) {
+		ERROR_OUT("Handoff socket path is too long: %s\n", config.handoff);
+		return -1;
+	}
+	strcpy(addr.sun_path, config.handoff);
+
+	handoff.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(handoff.fd < 0) {
+		ERRNO_OUT("Error creating handoff socket");
+		return -1;
+	}
+
+	// Any socket already there belongs to a server that has handed off its
+	// listening sockets or exited
+	unlink(config.handoff);
+	if(bind(handoff.fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(handoff.fd, 1)) {
+		ERRNO_OUT("Error listening on handoff socket %s", config.handoff);
+		return -1;
+	}
+
+	handoff.event = event_new(loops[0].evloop, handoff.fd, EV_READ | EV_PERSIST, handoff_connect, NULL);
+	if(CHECK_NULL(handoff.event) || event_add(handoff.event, NULL)) {
+		ERROR_OUT("Error scheduling handoff event.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Asks a running server listening on the handoff socket for its listening
+// sockets, storing up to max of them in fds.  Returns the number of sockets
+// received (0 if no server is running), or -1 on error.
+static int take_over(int *fds, int max)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * 1024)];
+		struct cmsghdr align;
+	} control;
+	struct timeval timeout = { 5, 0 };
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t count;
+	int sockfd;
+	int received = 0;
+	int *cmsg_fds;
+	int i, n;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(config.handoff) >= sizeof(addr.sun_path)) {
+		ERROR_OUT("Handoff socket path is too long: %s\n", config.handoff);
+		return -1;
+	}
+	strcpy(addr.sun_path, config.handoff);
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sockfd < 0) {
+		ERRNO_OUT("Error creating handoff socket");
+		return -1;
+	}
+	if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr))) {
+		if(errno != ENOENT && errno != ECONNREFUSED) {
+			ERRNO_OUT("Error connecting to handoff socket %s", config.handoff);
+		}
+		close(sockfd);
+		return 0;
+	}
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &count;
+	iov.iov_len = sizeof(count);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if(recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC) != sizeof(count)) {
+		ERRNO_OUT("Error receiving listening sockets from the running server");
+		close(sockfd);
+		return -1;
+	}
+	close(sockfd);
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		cmsg_fds = (int *)CMSG_DATA(cmsg);
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(i = 0; i < n; i++) {
+			if(received < max) {
+				fds[received++] = cmsg_fds[i];
+			} else {
+				// Connections waiting on these sockets are lost
+				ERROR_OUT("Closing extra listening socket from the running server.\n");
+				close(cmsg_fds[i]);
+			}
+		}
+	}
+
+	INFO_OUT("Took over %d listening sockets from the running server.\n", received);
+
+	return received;
+}
+
+// Runs an event loop until the server is shut down, then closes the loop's
+// connections.  Used as the thread function for loops other than loop 0.
+static void *run_cmdloop(void *arg)
+{
+	struct cmdloop *loop = arg;
+	cpu_set_t cpus;
+
+	// A pinned loop fills its pool itself, once it is on its CPU, so that
+	// the pool is in that CPU's NUMA node: Linux puts each page on the node
+	// of the CPU that first touches it, and glibc gives each thread its own
+	// heap.
+	if(loop->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(loop->cpu, &cpus);
+		errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if(errno) {
+			ERRNO_OUT("Error pinning event loop %d to CPU %d", loop->id, loop->cpu);
+		} else {
+			INFO_OUT("Event loop %d is running on CPU %d.\n", loop->id, loop->cpu);
+		}
+		if(config.pool_size && grow_pool(loop, config.pool_size)) {
+			ERROR_OUT("Error preallocating connections for event loop %d.\n", loop->id);
+		}
+	}
+
+	if(event_base_dispatch(loop->evloop)) {
+		ERROR_OUT("Error running event loop %d.\n", loop->id);
+	}
+
+	// Loop 0 has the signal handlers, so it keeps running until the other
+	// loops have exited, letting a second signal stop them while they
+	// drain.  If loop 0 exited on its own, stop the others (but let them
+	// finish draining).
+	if(loop->id == 0) {
+		if(!__atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+			stop_server();
+		}
+		while(__atomic_load_n(&loops_running, __ATOMIC_ACQUIRE) > 0) {
+			if(event_base_loop(loop->evloop, EVLOOP_ONCE) < 0) {
+				ERROR_OUT("Error running event loop %d.\n", loop->id);
+				break;
+			}
+		}
+	}
+
+	// Clean up and close open connections (the loop has already stopped, so
+	// it's no longer draining)
+	loop->draining = 0;
+	while(loop->nconns > 0) {
+		free_cmdsocket(loop->conns[loop->nconns - 1]);
+	}
+
+	// The last of the other loops to exit wakes loop 0 to notice
+	if(loop->id != 0 && __atomic_sub_fetch(&loops_running, 1, __ATOMIC_ACQ_REL) == 0) {
+		wake_loop(&loops[0], 0);
+	}
+
+	return NULL;
+}
+
+// The command lookup used before the hash table, kept for comparison
+static struct command *find_command_linear(struct command *cmds, size_t count, const char *name, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		if(!strncmp(name, cmds[i].name, len) && cmds[i].name[len] == 0) {
+			return &cmds[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Times hash table lookups against the linear search for tables of several
+// sizes.  The tables hold the real commands plus generated ones, and every
+// other lookup is for a name that isn't in the table.
+static int benchmark_lookup(void)
+{
+	static const size_t sizes[] = { ARRAY_SIZE(commands), 16, 128, 1024 };
+	const size_t max = 1024;
+	const size_t lookups = 4000000;
+	struct command *cmds;
+	struct cmdtable table;
+	char (*names)[32];
+	char (*queries)[32];
+	size_t *querylens;
+	size_t count, nqueries, found, q;
+	uint64_t start, linear_ns, hash_ns;
+	size_t i, j;
+	int ret = 0;
+
+	cmds = calloc(max, sizeof(struct command));
+	names = calloc(max, sizeof(*names));
+	queries = calloc(max * 2, sizeof(*queries));
+	querylens = calloc(max * 2, sizeof(*querylens));
+	if(cmds == NULL || names == NULL || queries == NULL || querylens == NULL) {
+		ERRNO_OUT("Error allocating benchmark data");
+		ret = -1;
+		goto done;
+	}
+
+	printf("%8s %14s %14s\n", "commands", "linear ns/op", "hash ns/op");
+
+	for(i = 0; i < ARRAY_SIZE(sizes); i++) {
+		count = sizes[i];
+		nqueries = count * 2;
+
+		for(j = 0; j < count; j++) {
+			if(j < ARRAY_SIZE(commands)) {
+				cmds[j] = commands[j];
+			} else {
+				snprintf(names[j], sizeof(names[j]), "site%zu", j);
+				cmds[j] = (struct command){ .name = names[j] };
+			}
+
+			snprintf(queries[j * 2], sizeof(queries[0]), "%s", cmds[j].name);
+			snprintf(queries[j * 2 + 1], sizeof(queries[0]), "nope%zu", j);
+		}
+		for(j = 0; j < nqueries; j++) {
+			querylens[j] = strlen(queries[j]);
+		}
+
+		if(build_cmdtable(&table, cmds, count)) {
+			ret = -1;
+			goto done;
+		}
+
+		found = 0;
+		start = nsec_now();
+		for(j = 0, q = 0; j < lookups; j++, q = q + 1 == nqueries ? 0 : q + 1) {
+			found += find_command_linear(cmds, count, queries[q], querylens[q]) != NULL;
+		}
+		linear_ns = nsec_now() - start;
+
+		start = nsec_now();
+		for(j = 0, q = 0; j < lookups; j++, q = q + 1 == nqueries ? 0 : q + 1) {
+			found += find_command(&table, queries[q], querylens[q]) != NULL;
+		}
+		hash_ns = nsec_now() - start;
+
+		free_cmdtable(&table);
+
+		if(found != lookups) {
+			ERROR_OUT("BUG: Expected %zu lookups to succeed, got %zu\n", lookups, found);
+			ret = -1;
+		}
+
+		printf("%8zu %14.1f %14.1f\n", count, (double)linear_ns / lookups, (double)hash_ns / lookups);
 	}
-	int tmp_reuse = 1;
-	if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &tmp_reuse, sizeof(tmp_reuse))) {
-		ERRNO_OUT("Error enabling socket address reuse on listening socket");
+
+done:
+	free(cmds);
+	free(names);
+	free(queries);
+	free(querylens);
+
+	return ret;
+}
+
+// Splits every line in the input with read_line()'s search followed by
+// split_line(), the way lines were handled before scan_lines().  Returns the
+// number of lines found, and adds their command name lengths to *cmdbytes.
+static size_t scan_readline(struct evbuffer *input, char *linebuf, size_t *cmdbytes)
+{
+	struct evbuffer_ptr eol;
+	struct evbuffer_iovec vec;
+	struct linespan span;
+	const char *line;
+	size_t eol_len;
+	size_t count = 0;
+
+	for(;;) {
+		eol = evbuffer_search_eol(input, NULL, &eol_len, EVBUFFER_EOL_ANY);
+		if(eol.pos < 0) {
+			return count;
+		}
+		if(evbuffer_peek(input, eol.pos, NULL, &vec, 1) >= 1 && vec.iov_len >= (size_t)eol.pos) {
+			line = vec.iov_base;
+		} else {
+			evbuffer_copyout(input, linebuf, eol.pos);
+			line = linebuf;
+		}
+		split_line(line, eol.pos, eol.pos + eol_len, &span);
+		*cmdbytes += span.cmdlen;
+		evbuffer_drain(input, span.consumed);
+		count++;
+	}
+}
+
+// Splits every line in the input with scan_lines(), SCAN_BATCH lines at a
+// time, draining each batch at once the way process_lines() does.
+static size_t scan_batched(struct evbuffer *input, size_t *cmdbytes)
+{
+	struct linespan spans[SCAN_BATCH];
+	struct evbuffer_iovec vec;
+	size_t count = 0, n, i, drain;
+	int chunks;
+
+	for(;;) {
+		chunks = evbuffer_peek(input, -1, NULL, &vec, 1);
+		if(chunks < 1) {
+			return count;
+		}
+		n = scan_lines(vec.iov_base, vec.iov_len, chunks == 1, spans, SCAN_BATCH);
+		if(n == 0) {
+			return count;
+		}
+		for(i = 0, drain = 0; i < n; i++) {
+			*cmdbytes += spans[i].cmdlen;
+			drain += spans[i].consumed;
+		}
+		evbuffer_drain(input, drain);
+		count += n;
+	}
+}
+
+// Times line splitting with read_line()'s search and with scan_lines() using
+// each block scanner the CPU supports, for short and long pipelined lines.
+static int benchmark_scan(void)
+{
+	static const size_t linelens[] = { 16, 4096 };
+	static const struct {
+		const char *name;
+		void (*func)(const char *p, struct scanblock *block);
+	} scanners[] = {
+		{ "scalar", scan_block_scalar },
+#ifdef __SSE2__
+		{ "sse2", scan_block_sse2 },
+		{ "avx2", scan_block_avx2 },
+#endif
+	};
+	const size_t total = 4 * 1024 * 1024;
+	const int rounds = 20;
+	void (*best)(const char *p, struct scanblock *block) = scan_block;
+	const char *best_name = scan_name;
+	struct evbuffer *input;
+	size_t nlines, found, cmdbytes, expect_cmdbytes;
+	size_t linelen, i, j;
+	uint64_t start, elapsed;
+	char *data, *linebuf;
+	int ret = 0;
+	int r;
+
+	data = malloc(total);
+	linebuf = malloc(total);
+	input = evbuffer_new();
+	if(data == NULL || linebuf == NULL || input == NULL) {
+		ERRNO_OUT("Error allocating benchmark data");
+		ret = -1;
+		goto done;
+	}
+
+	printf("Best scanner on this CPU: %s\n", best_name);
+	printf("%8s %10s %14s %14s\n", "line len", "method", "ns/line", "MB/s");
+
+	for(i = 0; i < ARRAY_SIZE(linelens); i++) {
+		// Lines of "echo xxx...x\r\n"
+		linelen = linelens[i];
+		nlines = total / linelen;
+		for(j = 0; j < nlines; j++) {
+			memset(data + j * linelen, 'x', linelen - 2);
+			memcpy(data + j * linelen, "echo ", 5);
+			memcpy(data + j * linelen + linelen - 2, "\r\n", 2);
+		}
+		expect_cmdbytes = nlines * rounds * 4;
+
+		for(j = 0; j <= ARRAY_SIZE(scanners); j++) {
+			if(j > 0) {
+				if(!strcmp(scanners[j - 1].name, "avx2") && strcmp(best_name, "avx2")) {
+					continue;
+				}
+				scan_block = scanners[j - 1].func;
+			}
+
+			found = 0;
+			cmdbytes = 0;
+			elapsed = 0;
+			for(r = 0; r < rounds; r++) {
+				if(evbuffer_add_reference(input, data, nlines * linelen, NULL, NULL)) {
+					ERROR_OUT("Error adding benchmark data to buffer.\n");
+					ret = -1;
+					goto done;
+				}
+				start = nsec_now();
+				if(j == 0) {
+					found += scan_readline(input, linebuf, &cmdbytes);
+				} else {
+					found += scan_batched(input, &cmdbytes);
+				}
+				elapsed += nsec_now() - start;
+			}
+
+			if(found != nlines * rounds || cmdbytes != expect_cmdbytes) {
+				ERROR_OUT("BUG: Expected %zu lines with %zu command bytes, got %zu with %zu\n",
+						nlines * rounds, expect_cmdbytes, found, cmdbytes);
+				ret = -1;
+			}
+
+			printf("%8zu %10s %14.1f %14.1f\n", linelen, j == 0 ? "readline" : scanners[j - 1].name,
+					(double)elapsed / found, (double)nlines * linelen * rounds * 1000.0 / elapsed);
+		}
+	}
+
+done:
+	scan_block = best;
+	if(input != NULL) {
+		evbuffer_free(input);
+	}
+	free(data);
+	free(linebuf);
+
+	return ret;
+}
+
+// Allocates the connection table with an entry for every file descriptor the
+// process may open.  Returns 0 on success, -1 on error.
+static int init_conn_table(void)
+{
+	struct rlimit limit;
+
+	if(getrlimit(RLIMIT_NOFILE, &limit)) {
+		ERRNO_OUT("Error getting the file descriptor limit");
 		return -1;
 	}
-	if(bind(listenfd, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
-		ERRNO_OUT("Error binding listening socket");
+
+	// Connections on fds past the end are just never found by id
+	conn_table.size = limit.rlim_cur;
+	if(limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 1 << 24) {
+		conn_table.size = 1 << 24;
+	}
+
+	conn_table.slots = calloc(conn_table.size, sizeof(struct connslot));
+	if(conn_table.slots == NULL) {
+		ERRNO_OUT("Error allocating a connection table for %zu file descriptors", conn_table.size);
 		return -1;
 	}
-	if(listen(listenfd, 8)) {
-		ERRNO_OUT("Error listening to listening socket");
+
+	return 0;
+}
+
+// Number of connections opened by --benchmark=idle (if there are enough file
+// descriptors for both ends of each)
+#define BENCH_IDLE_CONNS	8192
+
+// Returns the number of heap bytes currently allocated
+static size_t heap_in_use(void)
+{
+	return mallinfo2().uordblks;
+}
+
+// Runs the loop until it has nothing left to do right away
+static void run_idle_loop(struct cmdloop *loop)
+{
+	int i;
+
+	for(i = 0; i < 10; i++) {
+		loop->now = wheel_clock();
+		event_base_loop(loop->evloop, EVLOOP_NONBLOCK);
+	}
+}
+
+// Measures the heap memory each idle connection costs, with connections made
+// over socket pairs to a loop that isn't listening: first right after the
+// prompt is sent, then after each client has run a command and read the
+// reply, which is the state most of a long-running server's connections are
+// in.  Socket buffers are kernel memory and aren't counted.
+static int benchmark_idle(void)
+{
+	static const char command[] = "echo idle\n";
+	struct cmdloop *loop;
+	struct rlimit limit;
+	size_t count, before, connected, active, i;
+	int (*peers)[2] = NULL;
+	char reply[256];
+	int ret = 0;
+
+	cmdsets.current = load_cmdset();
+	if(cmdsets.current == NULL || init_conn_table() || getrlimit(RLIMIT_NOFILE, &limit)) {
 		return -1;
 	}
+	count = BENCH_IDLE_CONNS;
+	if(limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 2 < count + 32) {
+		count = limit.rlim_cur / 2 - 32;
+	}
 
-	// Set socket for non-blocking I/O
-	if(set_nonblock(listenfd)) {
-		ERROR_OUT("Error setting listening socket to non-blocking I/O.\n");
+	// A single loop with an empty pool, so that every connection's state is
+	// allocated while measuring
+	config.threads = 1;
+	config.port = 0;
+	config.unix_count = 0;
+	config.pool_size = 0;
+	config.timeout = 0;
+	loops = calloc(1, sizeof(struct cmdloop));
+	peers = calloc(count, sizeof(*peers));
+	if(loops == NULL || peers == NULL) {
+		ERRNO_OUT("Error allocating benchmark data");
+		ret = -1;
+		goto done;
+	}
+	loop = &loops[0];
+	if(init_cmdloop(loop, 0, -1, NULL)) {
+		ret = -1;
+		goto done;
+	}
+
+	before = heap_in_use();
+	for(i = 0; i < count; i++) {
+		if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, peers[i])) {
+			ERRNO_OUT("Error creating benchmark connection %zu", i);
+			count = i;
+			ret = -1;
+			goto done;
+		}
+		setup_connection(peers[i][0], 1, loop);
+	}
+	run_idle_loop(loop);
+	connected = heap_in_use();
+
+	for(i = 0; i < count; i++) {
+		while(read(peers[i][1], reply, sizeof(reply)) > 0) {
+		}
+		if(write(peers[i][1], command, strlen(command)) != (ssize_t)strlen(command)) {
+			ERRNO_OUT("Error sending benchmark command %zu", i);
+			ret = -1;
+			goto done;
+		}
+	}
+	run_idle_loop(loop);
+	for(i = 0; i < count; i++) {
+		while(read(peers[i][1], reply, sizeof(reply)) > 0) {
+		}
+	}
+	active = heap_in_use();
+
+	if(loop->nconns != count) {
+		ERROR_OUT("BUG: Expected %zu connections, found %zu\n", count, loop->nconns);
+		ret = -1;
+	}
+
+	printf("%zu idle connections, %zu bytes of struct cmdsocket each\n", count, sizeof(struct cmdsocket));
+	printf("%14s %14s\n", "state", "bytes/conn");
+	printf("%14s %14.1f\n", "connected", (double)(connected - before) / count);
+	printf("%14s %14.1f\n", "after command", (double)(active - before) / count);
+
+done:
+	if(loops != NULL) {
+		while(loops[0].nconns > 0) {
+			free_cmdsocket(loops[0].conns[0]);
+		}
+		free_cmdloop(&loops[0]);
+		free(loops);
+	}
+	for(i = 0; peers != NULL && i < count; i++) {
+		close(peers[i][1]);
+	}
+	free(peers);
+	put_cmdset(cmdsets.current);
+	free(conn_table.slots);
+
+	return ret;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  -l, --max-line=BYTES    Disconnect clients sending lines longer than BYTES (default %zu)\n"
+			"  -t, --threads=N         Run N event loop threads (default %zu)\n"
+			"  -p, --pool-size=N       Preallocate N connections per thread (default %zu)\n"
+			"  -g, --pool-grow=N       Grow a thread's connection pool by N at a time (default %zu)\n"
+			"  -T, --timeout=SECONDS   Disconnect clients idle for SECONDS, 0 for never (default %zu)\n"
+			"  -c, --cmd-budget=N      Run at most N commands per client before serving others (default %zu)\n"
+			"  -a, --accept-budget=N   Accept at most N connections per wakeup (default %zu)\n"
+			"  -b, --backlog=N         Queue up to N connections waiting to be accepted (default %zu)\n"
+			"  -P, --port=PORT         Listen for TCP clients on PORT, 0 for none (default %zu)\n"
+			"  -u, --unix=PATH         Listen for local clients on UNIX socket PATH (@NAME for abstract)\n"
+			"  -D, --defer-accept=SECONDS  Don't wake up for a connection until it sends data\n"
+			"  -k, --cork              Set TCP_CORK while processing pipelined commands\n"
+			"  -v, --log-level=LEVEL   Log messages up to LEVEL: none, error, info, debug (default info)\n"
+			"  -A, --async-log         Write log messages from a background thread\n"
+			"  -n, --cpus=LIST         Pin event loop threads to the CPUs in LIST (like 0-3,8), or auto\n"
+			"  -i, --steer             Accept each TCP connection on the loop pinned to its CPU\n"
+			"  -U, --io-uring          Accept, read, and write with io_uring instead of epoll\n"
+			"  -S, --tls-cert=FILE     Serve TLS with the certificate chain (and key) in PEM FILE\n"
+			"  -K, --tls-key=FILE      Read the TLS private key from PEM FILE\n"
+			"  -X, --ktls              Let the kernel encrypt TLS connections where it can\n"
+			"  -j, --workers=N         Run slow commands on N worker threads, 0 for none (default %zu)\n"
+			"  -s, --stats-interval=SECONDS  Log statistics every SECONDS, 0 for never (default %zu)\n"
+			"  -r, --read-high=BYTES   Read at most BYTES ahead from each client (default twice --max-line)\n"
+			"  -W, --write-high=BYTES  Pause clients with more than BYTES of unread output (default %zu)\n"
+			"  -L, --write-low=BYTES   Resume paused clients at BYTES of unread output (default %zu)\n"
+			"  -R, --rate=BYTES        Limit each client to BYTES per second each way, 0 for no limit\n"
+			"  -G, --global-rate=BYTES Limit all clients together to BYTES per second each way\n"
+			"  -C, --cmd-rate=N        Limit each client to N commands per second, 0 for no limit\n"
+			"  -w, --drain-timeout=SECONDS   Wait SECONDS for clients when shutting down, 0 for ever (default %zu)\n"
+			"  -H, --handoff=PATH      Take over from (and hand off to) other servers using PATH\n"
+			"  -x, --trace=N           Time the phases of one in N commands, 0 for none (default 0)\n"
+			"  -o, --trace-file=FILE   Save the traces to FILE on exit and on trace save\n"
+			"  -m, --module=PATH       Load commands from the shared object at PATH\n"
+			"  -B, --benchmark=NAME    Run a micro-benchmark (lookup, scan, idle) and exit\n"
+			"  -h, --help              Show this help\n",
+			progname, config.max_line, config.threads, config.pool_size, config.pool_grow, config.timeout,
+			config.cmd_budget, config.accept_budget, config.backlog, config.port, config.workers, config.stats_interval,
+			config.write_high, config.write_low, config.drain_timeout);
+}
+
+// Parses an unsigned decimal number in the range [min, max].  Returns 0 on
+// success, -1 on a malformed or out-of-range value.
+static int parse_size(const char *str, size_t min, size_t max, size_t *value)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if(errno || end == str || *end != 0 || *str == '-' || val < min || val > max) {
+		return -1;
+	}
+
+	*value = val;
+	return 0;
+}
+
+// Parses a --cpus list of CPU numbers and ranges (such as 0-3,8,10-11), or
+// "auto" for every CPU the server may run on, into config.cpus.  Returns 0 on
+// success, -1 on a malformed list or a CPU the server may not run on.
+static int parse_cpus(const char *str)
+{
+	cpu_set_t allowed;
+	unsigned long first, last;
+	char *end;
+	int cpu;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed)) {
+		ERRNO_OUT("Error getting the CPUs the server may run on");
+		return -1;
+	}
+
+	config.ncpus = 0;
+	if(!strcmp(str, "auto")) {
+		for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if(CPU_ISSET(cpu, &allowed)) {
+				config.cpus[config.ncpus++] = cpu;
+			}
+		}
+		return 0;
+	}
+
+	do {
+		if(*str < '0' || *str > '9') {
+			return -1;
+		}
+		first = strtoul(str, &end, 10);
+		last = first;
+		if(*end == '-') {
+			str = end + 1;
+			if(*str < '0' || *str > '9') {
+				return -1;
+			}
+			last = strtoul(str, &end, 10);
+		}
+		if(first > last || last >= CPU_SETSIZE || (*end != ',' && *end != 0)) {
+			return -1;
+		}
+
+		for(cpu = first; cpu <= (int)last; cpu++) {
+			if(!CPU_ISSET(cpu, &allowed)) {
+				ERROR_OUT("CPU %d isn't available to the server.\n", cpu);
+				return -1;
+			}
+			if(config.ncpus == CPU_SETSIZE) {
+				return -1;
+			}
+			config.cpus[config.ncpus++] = cpu;
+		}
+
+		str = end + 1;
+	} while(*end == ',');
+
+	return 0;
+}
+
+static int parse_args(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "max-line", required_argument, NULL, 'l' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "pool-size", required_argument, NULL, 'p' },
+		{ "pool-grow", required_argument, NULL, 'g' },
+		{ "timeout", required_argument, NULL, 'T' },
+		{ "cmd-budget", required_argument, NULL, 'c' },
+		{ "accept-budget", required_argument, NULL, 'a' },
+		{ "backlog", required_argument, NULL, 'b' },
+		{ "defer-accept", required_argument, NULL, 'D' },
+		{ "port", required_argument, NULL, 'P' },
+		{ "unix", required_argument, NULL, 'u' },
+		{ "cork", no_argument, NULL, 'k' },
+		{ "log-level", required_argument, NULL, 'v' },
+		{ "async-log", no_argument, NULL, 'A' },
+		{ "cpus", required_argument, NULL, 'n' },
+		{ "steer", no_argument, NULL, 'i' },
+		{ "io-uring", no_argument, NULL, 'U' },
+		{ "tls-cert", required_argument, NULL, 'S' },
+		{ "tls-key", required_argument, NULL, 'K' },
+		{ "ktls", no_argument, NULL, 'X' },
+		{ "workers", required_argument, NULL, 'j' },
+		{ "stats-interval", required_argument, NULL, 's' },
+		{ "read-high", required_argument, NULL, 'r' },
+		{ "write-high", required_argument, NULL, 'W' },
+		{ "write-low", required_argument, NULL, 'L' },
+		{ "rate", required_argument, NULL, 'R' },
+		{ "global-rate", required_argument, NULL, 'G' },
+		{ "cmd-rate", required_argument, NULL, 'C' },
+		{ "drain-timeout", required_argument, NULL, 'w' },
+		{ "handoff", required_argument, NULL, 'H' },
+		{ "trace", required_argument, NULL, 'x' },
+		{ "trace-file", required_argument, NULL, 'o' },
+		{ "module", required_argument, NULL, 'm' },
+		{ "benchmark", required_argument, NULL, 'B' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	static const char * const level_names[] = {
+		[LOG_NONE] = "none",
+		[LOG_ERROR] = "error",
+		[LOG_INFO] = "info",
+		[LOG_DEBUG] = "debug",
+	};
+	struct sockaddr_un local_addr;
+	socklen_t local_len;
+	int opt;
+	int i;
+
+	while((opt = getopt_long(argc, argv, "l:t:p:g:T:c:a:b:P:u:D:kv:An:iUS:K:Xj:s:r:W:L:R:G:C:w:H:x:o:m:B:h", options, NULL)) != -1) {
+		switch(opt) {
+			case 'l':
+				if(parse_size(optarg, 1, 1 << 30, &config.max_line)) {
+					ERROR_OUT("Invalid maximum line length: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 't':
+				if(parse_size(optarg, 1, 1024, &config.threads)) {
+					ERROR_OUT("Invalid thread count: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'p':
+				if(parse_size(optarg, 0, 1 << 24, &config.pool_size)) {
+					ERROR_OUT("Invalid pool size: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'g':
+				if(parse_size(optarg, 1, 1 << 24, &config.pool_grow)) {
+					ERROR_OUT("Invalid pool growth: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'T':
+				if(parse_size(optarg, 0, 86400 * 365, &config.timeout)) {
+					ERROR_OUT("Invalid timeout: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'c':
+				if(parse_size(optarg, 1, 1 << 20, &config.cmd_budget)) {
+					ERROR_OUT("Invalid command budget: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'a':
+				if(parse_size(optarg, 1, 1 << 20, &config.accept_budget)) {
+					ERROR_OUT("Invalid accept budget: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'b':
+				if(parse_size(optarg, 1, 1 << 20, &config.backlog)) {
+					ERROR_OUT("Invalid backlog: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'D':
+				if(parse_size(optarg, 0, 3600, &config.defer_accept)) {
+					ERROR_OUT("Invalid deferred accept timeout: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'P':
+				if(parse_size(optarg, 0, 65535, &config.port)) {
+					ERROR_OUT("Invalid port: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'u':
+				if(config.unix_count == MAX_LOCAL_LISTENERS) {
+					ERROR_OUT("At most %d UNIX sockets can be given.\n", MAX_LOCAL_LISTENERS);
+					return -1;
+				}
+				if(local_address(optarg, &local_addr, &local_len)) {
+					return -1;
+				}
+				config.unix_paths[config.unix_count++] = optarg;
+				break;
+
+			case 'k':
+				config.cork = 1;
+				break;
+
+			case 'v':
+				for(i = 0; i < ARRAY_SIZE(level_names); i++) {
+					if(!strcmp(optarg, level_names[i])) {
+						break;
+					}
+				}
+				if(i == ARRAY_SIZE(level_names)) {
+					ERROR_OUT("Invalid log level: %s\n", optarg);
+					return -1;
+				}
+				log_level = i;
+				if(log_level > LOG_LEVEL) {
+					fprintf(stderr, "Messages above level %s were compiled out.\n", level_names[LOG_LEVEL]);
+				}
+				break;
+
+			case 'A':
+				config.async_log = 1;
+				break;
+
+			case 'n':
+				if(parse_cpus(optarg)) {
+					ERROR_OUT("Invalid CPU list: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'i':
+				config.steer = 1;
+				break;
+
+			case 'U':
+#ifdef HAVE_IO_URING
+				config.io_uring = 1;
+				break;
+#else
+				ERROR_OUT("This server was built without io_uring support.\n");
+				return -1;
+#endif
+
+			case 'j':
+				if(parse_size(optarg, 0, 1024, &config.workers)) {
+					ERROR_OUT("Invalid worker count: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 's':
+				if(parse_size(optarg, 0, 86400 * 365, &config.stats_interval)) {
+					ERROR_OUT("Invalid statistics interval: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'r':
+				if(parse_size(optarg, 1, (size_t)1 << 32, &config.read_high)) {
+					ERROR_OUT("Invalid read high-water mark: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'W':
+				if(parse_size(optarg, 1, (size_t)1 << 32, &config.write_high)) {
+					ERROR_OUT("Invalid write high-water mark: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'L':
+				if(parse_size(optarg, 0, (size_t)1 << 32, &config.write_low)) {
+					ERROR_OUT("Invalid write low-water mark: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'R':
+				if(parse_size(optarg, 0, 1 << 30, &config.rate)) {
+					ERROR_OUT("Invalid rate limit: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'G':
+				if(parse_size(optarg, 0, 1 << 30, &config.global_rate)) {
+					ERROR_OUT("Invalid global rate limit: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'C':
+				if(parse_size(optarg, 0, 1000000, &config.cmd_rate)) {
+					ERROR_OUT("Invalid command rate limit: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'w':
+				if(parse_size(optarg, 0, 86400, &config.drain_timeout)) {
+					ERROR_OUT("Invalid drain timeout: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'S':
+				config.tls_cert = optarg;
+				break;
+
+			case 'K':
+				config.tls_key = optarg;
+				break;
+
+			case 'X':
+				config.ktls = 1;
+				break;
+
+			case 'H':
+				config.handoff = optarg;
+				break;
+
+			case 'x':
+				if(parse_size(optarg, 0, 1 << 30, &config.trace)) {
+					ERROR_OUT("Invalid trace sampling rate: %s\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'o':
+				config.trace_file = optarg;
+				break;
+
+			case 'm':
+				if(config.module_count == MAX_MODULES) {
+					ERROR_OUT("At most %d modules can be given.\n", MAX_MODULES);
+					return -1;
+				}
+				config.module_paths[config.module_count++] = optarg;
+				break;
+
+			case 'B':
+				config.benchmark = optarg;
+				break;
+
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if(optind < argc) {
+		ERROR_OUT("Unexpected argument: %s\n", argv[optind]);
+		usage(argv[0]);
+		return -1;
+	}
+
+	// A whole line (or frame) has to fit in the input buffer
+	if(config.read_high == 0) {
+		config.read_high = config.max_line * 2;
+	}
+	if(config.read_high <= config.max_line + BIN_HEADER) {
+		ERROR_OUT("The read high-water mark must be more than %zu bytes.\n", config.max_line + BIN_HEADER);
+		return -1;
+	}
+	if(config.write_low > config.write_high) {
+		ERROR_OUT("The write low-water mark can't be above the high-water mark.\n");
+		return -1;
+	}
+	if(config.io_uring && (config.rate || config.global_rate)) {
+		ERROR_OUT("Byte rate limits are done by libevent, so they can't be used with io_uring.\n");
+		return -1;
+	}
+	if(config.port == 0 && config.unix_count == 0) {
+		ERROR_OUT("There is nothing to listen on without a TCP port or a UNIX socket.\n");
+		return -1;
+	}
+	if(config.trace_file != NULL && config.trace == 0) {
+		ERROR_OUT("A trace file needs tracing (--trace).\n");
+		return -1;
+	}
+	if(config.steer && (config.ncpus == 0 || config.port == 0)) {
+		ERROR_OUT("Steering connections needs pinned loops (--cpus) and a TCP port.\n");
+		return -1;
+	}
+	if(config.tls_cert == NULL && (config.tls_key != NULL || config.ktls)) {
+		ERROR_OUT("TLS options need a certificate (--tls-cert).\n");
+		return -1;
+	}
+#ifndef HAVE_TLS
+	if(config.tls_cert != NULL) {
+		ERROR_OUT("This server was built without TLS support (see make tls).\n");
+		return -1;
+	}
+#endif
+	if(config.io_uring && config.tls_cert != NULL) {
+		ERROR_OUT("TLS is done by libevent, so it can't be used with io_uring.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct event *sigint_event = NULL, *sigterm_event = NULL;
+	sigset_t sigset, oldset;
+	int listenfds[1024];
+	int nlistenfds = 0;
+	int localfds[MAX_LOCAL_LISTENERS];
+	int ret = 0;
+	int started = 1;
+	size_t busy;
+	int i;
+
+	if(parse_args(argc, argv)) {
+		return -1;
+	}
+
+	init_scanner();
+
+	if(config.benchmark != NULL) {
+		if(!strcmp(config.benchmark, "lookup")) {
+			return benchmark_lookup();
+		}
+		if(!strcmp(config.benchmark, "scan")) {
+			return benchmark_scan();
+		}
+		if(!strcmp(config.benchmark, "idle")) {
+			return benchmark_idle();
+		}
+		ERROR_OUT("Unknown benchmark: %s\n", config.benchmark);
+		return -1;
+	}
+
+	cmdsets.current = load_cmdset();
+	if(cmdsets.current == NULL || init_conn_table()) {
+		return -1;
+	}
+	if(config.module_count) {
+		INFO_OUT("Loaded %zu commands from %zu modules.\n",
+				cmdsets.current->count - ARRAY_SIZE(commands), cmdsets.current->nmodules);
+	}
+
+	if(config.async_log) {
+		start_async_log();
+	}
+
+	// Take over the listening sockets of a server being restarted.  Closing
+	// any of them would lose the connections waiting on it, so there must be
+	// at least one loop per socket.
+	if(config.handoff != NULL) {
+		nlistenfds = take_over(listenfds, ARRAY_SIZE(listenfds));
+		if(nlistenfds < 0) {
+			return -1;
+		}
+	}
+
+	// Every loop serves every UNIX socket, so only the TCP sockets need a
+	// loop each
+	if(open_local_listeners(listenfds, &nlistenfds, localfds)) {
+		return -1;
+	}
+	if(nlistenfds > config.threads) {
+		INFO_OUT("Running %d threads to serve every listening socket.\n", nlistenfds);
+		config.threads = nlistenfds;
+	}
+
+	// Initialize libevent
+	INFO_OUT("libevent version: %s\n", event_get_version());
+	if(init_rate_limits() || init_tls()) {
 		return -1;
 	}
 
-	// Add an event to wait for connections
-	event_set(&connect_event, listenfd, EV_READ | EV_PERSIST, cmd_connect, evloop);
-	event_base_set(evloop, &connect_event);
-	if(event_add(&connect_event, NULL)) {
-		ERROR_OUT("Error scheduling connection event on the event loop.\n");
+	loops = calloc(config.threads, sizeof(struct cmdloop));
+	if(loops == NULL) {
+		ERRNO_OUT("Error allocating event loops");
+		return -1;
+	}
+
+	for(i = 0; i < config.threads; i++) {
+		if(init_cmdloop(&loops[i], i, i < nlistenfds ? listenfds[i] : -1, localfds)) {
+			ret = -1;
+			config.threads = i + 1;
+			goto cleanup;
+		}
+	}
+	INFO_OUT("libevent is using %s for events.\n", event_base_get_method(loops[0].evloop));
+
+	// With one loop there is nothing to steer (and no SO_REUSEPORT group)
+	if(config.steer && config.threads > 1 && steer_connections()) {
+		ret = -1;
+		goto cleanup;
+	}
+
+	if(config.handoff != NULL && listen_handoff()) {
+		ret = -1;
+		goto cleanup;
 	}
 
+	// Set signal handlers (on loop 0, which runs in the main thread)
+	sigint_event = evsignal_new(loops[0].evloop, SIGINT, sighandler, NULL);
+	sigterm_event = evsignal_new(loops[0].evloop, SIGTERM, sighandler, NULL);
+	if(CHECK_NULL(sigint_event) || CHECK_NULL(sigterm_event) ||
+			event_add(sigint_event, NULL) || event_add(sigterm_event, NULL)) {
+		ERROR_OUT("Error setting signal handlers.\n");
+	}
+
+	// Writing to a client that has disconnected (or that was shut down by
+	// the quit command) should fail with EPIPE instead of killing the server
+	signal(SIGPIPE, SIG_IGN);
+
+	// Start the other event loops and the workers with signals blocked so
+	// that only the main thread receives them
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+	start_workers();
+	loops_running = config.threads - 1;
+	for(; started < config.threads; started++) {
+		errno = pthread_create(&loops[started].thread, NULL, run_cmdloop, &loops[started]);
+		if(errno) {
+			ERRNO_OUT("Error starting thread for event loop %d", started);
+			__atomic_sub_fetch(&loops_running, config.threads - started, __ATOMIC_ACQ_REL);
+			stop_server();
+			ret = -1;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
 
-	// Start the event loop
-	if(event_base_dispatch(evloop)) {
-		ERROR_OUT("Error running event loop.\n");
+	// Run loop 0 in the main thread
+	if(ret == 0) {
+		run_cmdloop(&loops[0]);
 	}
 
 	INFO_OUT("Server is shutting down.\n");
 
-	// Clean up and close open connections
-	while(socketlist->next != NULL) {
-		free_cmdsocket(socketlist->next);
+	for(i = 1; i < started; i++) {
+		errno = pthread_join(loops[i].thread, NULL);
+		if(errno) {
+			ERRNO_OUT("Error waiting for event loop %d to exit", i);
+		}
+	}
+
+	if(sigint_event != NULL) {
+		event_free(sigint_event);
+	}
+	if(sigterm_event != NULL) {
+		event_free(sigterm_event);
+	}
+
+cleanup:
+	// Workers may still be returning jobs to the loops
+	busy = stop_workers();
+
+	if(handoff.event != NULL) {
+		event_free(handoff.event);
+	}
+	if(handoff.fd >= 0) {
+		close(handoff.fd);
 	}
 
-	// Clean up libevent
-	if(event_del(&connect_event)) {
-		ERROR_OUT("Error removing connection event from the event loop.\n");
+	if(config.trace_file != NULL && write_traces() >= 0) {
+		INFO_OUT("Wrote traces to %s.\n", config.trace_file);
 	}
-	event_base_free(evloop);
-	if(close(listenfd)) {
-		ERRNO_OUT("Error closing listening socket");
+
+	remove_local_listeners();
+
+	// Clean up libevent (unless a command that could still use it is
+	// running on a worker, in which case exiting frees it all)
+	if(busy == 0) {
+		for(i = 0; i < config.threads; i++) {
+			free_cmdloop(&loops[i]);
+		}
+		free(loops);
+		free_rate_limits();
+		free_tls();
+		put_cmdset(cmdsets.current);
+		free(conn_table.slots);
 	}
 
 	INFO_OUT("Goodbye.\n");
+	stop_async_log();
 
-	return 0;
+	return ret;
 }
-
@@ -0,0 +1,43 @@
+/*
+ * The interface between cliserver and its command modules (see --module).
+ *
+ * A module is a shared object that exports module_version, set to
+ * MODULE_VERSION, and module_commands, an array of commands ended by one with
+ * a NULL name.  The server copies the commands into its command table when it
+ * starts and whenever the reload command is run, after the built-in commands.
+ *
+ * A command's func writes its reply to out, and must copy anything it adds
+ * there (a module may be unloaded as soon as the reply has been sent).
+ * Commands flagged CMD_OFFLOAD run on a worker thread with a NULL cmdsocket;
+ * the others run on the client's event loop, and must not block.  Either way,
+ * cmdsocket is opaque to modules.
+ *
+ * (C)2010 Mike Bourgeous, licensed under 2-clause BSD
+ */
+
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <stddef.h>
+
+#define MODULE_VERSION 1
+
+struct cmdsocket;
+struct evbuffer;
+
+struct command {
+	char *name;
+	char *desc;
+	void (*func)(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len);
+
+	// CMD_* flags
+	int flags;
+
+	// Length of name (filled in when the command table is built)
+	size_t namelen;
+};
+
+// Values for command->flags
+#define CMD_OFFLOAD	0x1	// Slow or blocking; run on a worker thread if --workers isn't 0
+
+#endif /* MODULE_H */
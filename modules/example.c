@@ -0,0 +1,64 @@
+/*
+ * An example command module for cliserver.  Build it with make modules, then
+ * run ./cliserver --module=modules/example.so.
+ *
+ * (C)2010 Mike Bourgeous, licensed under 2-clause BSD
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <event2/buffer.h>
+
+#include "../module.h"
+
+// Prints the command line in upper case
+static void upper_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct evbuffer_iovec vec;
+	char *p;
+	size_t i;
+
+	if(evbuffer_reserve_space(out, len + 1, &vec, 1) < 1) {
+		return;
+	}
+	p = vec.iov_base;
+	for(i = 0; i < len; i++) {
+		p[i] = toupper((unsigned char)params[i]);
+	}
+	p[len] = '\n';
+	vec.iov_len = len + 1;
+	evbuffer_commit_space(out, &vec, 1);
+}
+
+// Waits the given number of milliseconds (at most 10 seconds) before replying
+static void sleep_func(struct cmdsocket *cmdsocket, struct evbuffer *out, struct command *command, const char *params, size_t len)
+{
+	struct timespec delay;
+	char buf[16];
+	long ms = 0;
+
+	if(len > 0 && len < sizeof(buf)) {
+		memcpy(buf, params, len);
+		buf[len] = 0;
+		ms = strtol(buf, NULL, 10);
+	}
+	if(ms < 0 || ms > 10000) {
+		evbuffer_add_printf(out, "Usage: sleep MILLISECONDS (up to 10000)\n");
+		return;
+	}
+
+	delay.tv_sec = ms / 1000;
+	delay.tv_nsec = ms % 1000 * 1000000;
+	nanosleep(&delay, NULL);
+	evbuffer_add_printf(out, "Slept %ld ms\n", ms);
+}
+
+const int module_version = MODULE_VERSION;
+
+struct command module_commands[] = {
+	{ "upper", "Prints the command line in upper case.", upper_func },
+	{ "sleep", "Waits the given number of milliseconds, then replies.", sleep_func, CMD_OFFLOAD },
+	{ NULL }
+};